@@ -0,0 +1,89 @@
+// Cost of reordering batches by series and time. Times sort_batch on a
+// batch of points from 1000 series in arrival order, then writes the same
+// points to a server with each batch_order and reports how long the
+// server took to accept them.
+//
+//   batch_sort [url] [batches]
+
+#include <cstdlib>
+#include <iostream>
+
+#include <influxdb.hpp>
+
+namespace {
+    const size_t series = 1000;
+    const size_t points_per_batch = 5000;
+
+    influxdb::metric make_point(size_t i) {
+        influxdb::metric m("cpu");
+        m.add_tag("host", "server" + std::to_string(i * 7919 % series)).add_field("usage", static_cast<double>(i));
+        m.set_timestamp(std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::nanoseconds(1600000000000000000LL + static_cast<int64_t>(i) * 1000))));
+        return m;
+    }
+
+    void time_sort(size_t rounds) {
+        influxdb::memory_transport* memory = new influxdb::memory_transport();
+        influxdb::batching_client client(std::unique_ptr<influxdb::transport>(memory),
+                                         influxdb::precision::nano, 64 * 1024 * 1024);
+
+        for (size_t i = 0; i < points_per_batch; i++) {
+            influxdb::metric m = make_point(i);
+            client.add_metric(m);
+        }
+
+        client.write_metrics();
+        client.update();
+
+        const std::string original = memory->get_batches().front();
+        std::string body;
+        std::vector<influxdb::detail::line_ref> lines;
+        std::vector<influxdb::detail::line_ref> scratch;
+        double ns = 0;
+
+        for (size_t r = 0; r < rounds; r++) {
+            body = original;
+            auto start = std::chrono::steady_clock::now();
+            influxdb::detail::sort_batch(body, lines, scratch);
+            ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        std::cout << "sort: " << ns / rounds / 1e3 << " us per " << original.size() / 1024 << " KB batch, "
+                  << ns / rounds / points_per_batch << " ns/point\n";
+    }
+
+    void time_server(const std::string& url, size_t batches, influxdb::batch_order order, const char* name) {
+        influxdb::influxdb_client client(url, "bench", influxdb::precision::nano, 1 << 20, true);
+        client.set_batch_order(order);
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (size_t b = 0; b < batches; b++) {
+            for (size_t i = 0; i < points_per_batch; i++) {
+                influxdb::metric m = make_point(b * points_per_batch + i);
+                client.add_metric(m);
+            }
+
+            client.write_metrics();
+            client.update();
+        }
+
+        bool drained = client.shutdown(std::chrono::seconds(60));
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << name << ": " << ms / batches << " ms/batch, " << client.get_failures().size() << " failed"
+                  << (drained ? "" : ", not drained") << "\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string url = argc > 1 ? argv[1] : "http://127.0.0.1:8086";
+    size_t batches = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 200;
+
+    time_sort(100);
+
+    influxdb::initialize();
+    time_server(url, batches, influxdb::batch_order::arrival, "arrival    ");
+    time_server(url, batches, influxdb::batch_order::series_time, "series_time");
+    influxdb::cleanup();
+}
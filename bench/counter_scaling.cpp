@@ -0,0 +1,51 @@
+// Scaling of sharded_counter against a single atomic from 1 to 64
+// threads, all incrementing the same counter. Reports nanoseconds per
+// increment; a counter that scales keeps that flat as threads are added,
+// up to the number of CPUs. shards overrides the default of one per CPU.
+//
+//   counter_scaling [increments per thread] [shards]
+
+#include <cstdlib>
+#include <iostream>
+
+#include <influxdb_registry.hpp>
+
+namespace {
+    template<typename F>
+    double run(size_t threads, size_t increments, F f) {
+        std::vector<std::thread> workers;
+        auto start = std::chrono::steady_clock::now();
+
+        for (size_t t = 0; t < threads; t++)
+            workers.emplace_back([&] {
+                for (size_t i = 0; i < increments; i++)
+                    f();
+            });
+
+        for (auto& w : workers)
+            w.join();
+
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()
+               / (static_cast<double>(increments) * threads);
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t increments = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000000;
+    size_t shards = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 0;
+
+    influxdb::sharded_counter sharded(shards);
+    std::atomic<uint64_t> single(0);
+
+    std::cout << "cpus: " << std::thread::hardware_concurrency() << ", shards: " << sharded.shard_count() << "\n";
+
+    for (size_t threads = 1; threads <= 64; threads *= 2) {
+        double a = run(threads, increments, [&] { single.fetch_add(1, std::memory_order_relaxed); });
+        double s = run(threads, increments, [&] { sharded.increment(); });
+
+        std::cout << threads << " threads: atomic " << a << " ns, sharded " << s << " ns\n";
+    }
+
+    if (sharded.value() != single.load())
+        std::cout << "mismatch: sharded " << sharded.value() << ", atomic " << single.load() << "\n";
+}
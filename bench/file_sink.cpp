@@ -0,0 +1,128 @@
+// Sustained throughput of file_transport with the default sync cadence.
+// Ready made 256 KB batches are written straight to the transport to show
+// what the sink itself sustains, then points go through a client into
+// plain and compressed segments. Throughput is in line protocol MB/s and
+// includes closing and compressing the last segment.
+//
+//   file_sink [directory] [points]
+
+#define INFLUXDB_WITH_ZLIB
+
+#include <cstdlib>
+#include <iostream>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <influxdb_file.hpp>
+
+namespace {
+    // Removes the segments of earlier runs and returns their total size
+    size_t clear_segments(const std::string& directory) {
+        size_t total = 0;
+        DIR* dir = opendir(directory.c_str());
+
+        if (dir == nullptr)
+            return 0;
+
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+
+            if (name.compare(0, 6, "bench-") != 0)
+                continue;
+
+            std::string path = directory + "/" + name;
+            struct stat st;
+
+            if (stat(path.c_str(), &st) == 0)
+                total += st.st_size;
+
+            unlink(path.c_str());
+        }
+
+        closedir(dir);
+        return total;
+    }
+
+    // Writes total bytes of the same body without a client
+    double run_transport(const std::string& directory, size_t total) {
+        influxdb::file_options options;
+        options.directory = directory;
+        options.prefix = "bench";
+
+        std::string body;
+        while (body.size() < 256 * 1024)
+            body += "cpu,host=server01,region=eu-west usage=42.5 1600000000000000000\n";
+
+        std::vector<influxdb::completion> done;
+        size_t written = 0;
+        auto start = std::chrono::steady_clock::now();
+
+        {
+            influxdb::file_transport file(options);
+
+            for (uint64_t id = 0; written < total; id++) {
+                file.send(id, body);
+                written += body.size();
+
+                if (id % 16 == 15)
+                    file.poll(done);
+            }
+
+            file.poll(done);
+        }
+
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        clear_segments(directory);
+        return written / s / 1e6;
+    }
+
+    struct result {
+        double seconds;
+        size_t stored;
+    };
+
+    result run(const std::string& directory, size_t points, bool compress) {
+        influxdb::file_options options;
+        options.directory = directory;
+        options.prefix = "bench";
+        options.max_segment_bytes = 16 * 1024 * 1024;
+        options.compress = compress;
+
+        auto start = std::chrono::steady_clock::now();
+
+        {
+            influxdb::file_transport* file = new influxdb::file_transport(options);
+            influxdb::batching_client client(std::unique_ptr<influxdb::transport>(file),
+                                             influxdb::precision::nano, 256 * 1024);
+
+            for (size_t i = 0; i < points; i++) {
+                influxdb::metric m("cpu");
+                m.add_tag("host", "server01").add_tag("region", "eu-west").add_field("usage", static_cast<double>(i));
+                client.add_metric(m);
+
+                if (i % 1024 == 1023)
+                    client.update();
+            }
+
+            client.shutdown(std::chrono::seconds(60));
+        }
+
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return { s, clear_segments(directory) };
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string directory = argc > 1 ? argv[1] : ".";
+    size_t points = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2000000;
+
+    clear_segments(directory);
+    std::cout << "sink:  " << run_transport(directory, 1024 * 1024 * 1024) << " MB/s\n";
+
+    result plain = run(directory, points, false);
+    result gzip = run(directory, points, true);
+    double mb = plain.stored / 1e6;
+
+    std::cout << "plain: " << mb / plain.seconds << " MB/s, " << mb << " MB\n"
+              << "gzip:  " << mb / gzip.seconds << " MB/s, " << gzip.stored / 1e6 << " MB on disk\n";
+}
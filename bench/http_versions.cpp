@@ -0,0 +1,49 @@
+// Writes the same batches over HTTP/1.1 keep-alive and over HTTP/2 with
+// prior knowledge (h2c), reporting batches per second for each. The
+// server must accept both, e.g. the mock behind an h2c proxy:
+//
+//   nghttpx --frontend-no-tls -f127.0.0.1,8087 -b127.0.0.1,8086
+//   http_versions http://127.0.0.1:8087 [batches]
+
+#include <cstdlib>
+#include <iostream>
+
+#include <influxdb.hpp>
+
+namespace {
+    const size_t points_per_batch = 100;
+
+    void run(const std::string& url, size_t batches, influxdb::http_version version, const char* name) {
+        influxdb::influxdb_client client(url, "bench", influxdb::precision::nano, 1 << 20, true);
+        client.set_http_version(version);
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (size_t b = 0; b < batches; b++) {
+            for (size_t i = 0; i < points_per_batch; i++) {
+                influxdb::metric m("cpu");
+                m.add_tag("host", "server01").add_field("usage", static_cast<double>(i));
+                client.add_metric(m);
+            }
+
+            client.write_metrics();
+            client.update();
+        }
+
+        bool drained = client.shutdown(std::chrono::seconds(60));
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << name << ": " << batches / s << " batches/s, " << client.get_failures().size() << " failed"
+                  << (drained ? "" : ", not drained") << "\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string url = argc > 1 ? argv[1] : "http://127.0.0.1:8086";
+    size_t batches = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2000;
+
+    influxdb::initialize();
+    run(url, batches, influxdb::http_version::http_1_1, "HTTP/1.1");
+    run(url, batches, influxdb::http_version::http_2_prior_knowledge, "HTTP/2");
+    influxdb::cleanup();
+}
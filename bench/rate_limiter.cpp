@@ -0,0 +1,88 @@
+// Cost of the outgoing rate limiter. Times the check made for each batch
+// on its own, then writes the same points through a client on
+// memory_transport with no limit and with a limit too high to ever hold a
+// batch back, so the difference is the limiter's share of the dispatch path.
+//
+//   rate_limiter [points]
+
+#include <cstdlib>
+#include <iostream>
+
+#include <influxdb.hpp>
+
+namespace {
+    struct result {
+        double ns_per_point;
+        double ns_per_batch;
+    };
+
+    // the byte and point buckets checked and charged for each batch
+    double check_cost(size_t checks) {
+        influxdb::token_bucket bytes(1e12, 1.0);
+        influxdb::token_bucket points(1e12, 1.0);
+        size_t passed = 0;
+        auto start = std::chrono::steady_clock::now();
+
+        for (size_t i = 0; i < checks; i++) {
+            auto now = std::chrono::steady_clock::now();
+
+            if (bytes.can_consume(4096, now) && points.can_consume(80, now)) {
+                bytes.consume(4096);
+                points.consume(80);
+                passed++;
+            }
+        }
+
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        return passed == checks ? ns / checks : 0;
+    }
+
+    result run(size_t points, bool limited) {
+        influxdb::memory_transport* memory = new influxdb::memory_transport();
+        influxdb::batching_client client(std::unique_ptr<influxdb::transport>(memory),
+                                         influxdb::precision::nano, 4096);
+
+        if (limited) {
+            influxdb::rate_limit limit;
+            limit.bytes_per_second = 1e12;
+            limit.points_per_second = 1e12;
+            client.set_rate_limit(limit);
+        }
+
+        size_t batches = 0;
+        auto start = std::chrono::steady_clock::now();
+
+        for (size_t i = 0; i < points; i++) {
+            influxdb::metric m("cpu");
+            m.add_tag("host", "server01").add_field("usage", static_cast<double>(i));
+            client.add_metric(m);
+
+            if (i % 64 == 63) {
+                client.update();
+                batches += memory->get_batches().size();
+                memory->clear();
+            }
+        }
+
+        client.write_metrics();
+        client.update();
+        batches += memory->get_batches().size();
+
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        return { ns / points, ns / batches };
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t points = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000000;
+
+    // the first pass warms up the allocator and caches
+    run(points / 10, false);
+
+    result plain = run(points, false);
+    result limited = run(points, true);
+
+    std::cout << "limiter check: " << check_cost(points) << " ns/batch\n"
+              << "no limit:   " << plain.ns_per_point << " ns/point, " << plain.ns_per_batch << " ns/batch\n"
+              << "rate limit: " << limited.ns_per_point << " ns/point, " << limited.ns_per_batch << " ns/batch\n";
+}
@@ -0,0 +1,54 @@
+// Cost of a scoped_timer in an inner loop. Times the same loop body with
+// and without a timer around it; the difference is what one timed scope
+// costs, both clock reads and the histogram update included.
+//
+//   timer_cost [iterations]
+
+#include <cstdlib>
+#include <iostream>
+
+#include <influxdb_registry.hpp>
+
+namespace {
+    volatile uint64_t sink;
+
+    double loop(size_t iterations, influxdb::latency_histogram* histogram) {
+        uint64_t x = 0;
+        auto start = std::chrono::steady_clock::now();
+
+        if (histogram != nullptr) {
+            for (size_t i = 0; i < iterations; i++) {
+                influxdb::scoped_timer timer(*histogram);
+                x += i * i;
+                sink = x;
+            }
+        }
+        else {
+            for (size_t i = 0; i < iterations; i++) {
+                x += i * i;
+                sink = x;
+            }
+        }
+
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 50000000;
+
+    influxdb::memory_transport* memory = new influxdb::memory_transport();
+    influxdb::batching_client client(std::unique_ptr<influxdb::transport>(memory), influxdb::precision::second, 1 << 20);
+    influxdb::registry registry(client);
+    influxdb::latency_histogram& histogram = registry.add_histogram(influxdb::metric("bench"));
+
+    // calibrates the clock before anything is timed
+    loop(iterations / 10, &histogram);
+
+    double timed = loop(iterations, &histogram);
+    double bare = loop(iterations, nullptr);
+
+    std::cout << "clock: " << (influxdb::detail::tick_clock::get().is_tsc() ? "tsc" : "steady_clock") << "\n"
+              << "with timer: " << timed << " ns/iteration, without: " << bare << " ns/iteration, "
+              << "timer: " << timed - bare << " ns\n";
+}
@@ -0,0 +1,59 @@
+// Writes the same batches through influxdb_client (libcurl) and
+// uring_client (io_uring), reporting batches per second and the client's
+// CPU time per batch, which is what the io_uring transport saves when the
+// server is the bottleneck.
+//
+//   uring_vs_curl [url] [batches]
+
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+
+#include <influxdb.hpp>
+#include <influxdb_uring.hpp>
+
+namespace {
+    const size_t points_per_batch = 100;
+
+    void run(influxdb::batching_client& client, size_t batches, const char* name) {
+        auto start = std::chrono::steady_clock::now();
+        std::clock_t cpu_start = std::clock();
+
+        for (size_t b = 0; b < batches; b++) {
+            for (size_t i = 0; i < points_per_batch; i++) {
+                influxdb::metric m("cpu");
+                m.add_tag("host", "server01").add_field("usage", static_cast<double>(i));
+                client.add_metric(m);
+            }
+
+            client.write_metrics();
+            client.update();
+        }
+
+        bool drained = client.shutdown(std::chrono::seconds(60));
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double cpu_us = 1e6 * (std::clock() - cpu_start) / CLOCKS_PER_SEC;
+
+        std::cout << name << ": " << batches / s << " batches/s, " << cpu_us / batches << " us CPU/batch, "
+                  << client.get_failures().size() << " failed" << (drained ? "" : ", not drained") << "\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string url = argc > 1 ? argv[1] : "http://127.0.0.1:8086";
+    size_t batches = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2000;
+
+    influxdb::initialize();
+
+    {
+        influxdb::influxdb_client client(url, "bench", influxdb::precision::nano, 1 << 20, true);
+        run(client, batches, "libcurl ");
+    }
+
+    {
+        influxdb::uring_client client(url, "bench", influxdb::precision::nano, 1 << 20, true);
+        run(client, batches, "io_uring");
+    }
+
+    influxdb::cleanup();
+}
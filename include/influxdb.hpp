@@ -6,7 +6,19 @@
 #include <chrono>
 #include <regex>
 #include <algorithm>
+#include <array>
 #include <exception>
+#include <stdexcept>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <unordered_map>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
 #include <curl/curl.h>
 
 #ifndef FMT_HEADER_ONLY
@@ -14,6 +26,22 @@
 #endif
 #include "fmt/format.h"
 
+// Statically defined tracepoints for perf and bpftrace, built in whenever
+// <sys/sdt.h> is available unless INFLUXDB_WITHOUT_USDT is defined. A probe
+// is a single nop until a tracer attaches. Arguments must be integers.
+#if !defined(INFLUXDB_WITHOUT_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define INFLUXDB_HAVE_USDT 1
+#endif
+#endif
+
+#ifdef INFLUXDB_HAVE_USDT
+#define INFLUXDB_PROBE(...) STAP_PROBEV(influxdb, __VA_ARGS__)
+#else
+#define INFLUXDB_PROBE(...) do {} while (0)
+#endif
+
 namespace influxdb {
     inline bool initialize() {
         return (curl_global_init(CURL_GLOBAL_ALL) == 0);
@@ -32,12 +60,238 @@ namespace influxdb {
         hour
     };
 
+    // Points of each class are batched and sent separately, critical
+    // batches are dispatched first and shed last
+    enum class priority : uint8_t {
+        critical,
+        normal,
+        best_effort
+    };
+
+    namespace detail {
+        // CPU time consumed by the calling thread
+        inline std::chrono::nanoseconds thread_cpu_time() {
+            timespec ts;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+            return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+        }
+
+        // Shortest of 15 or 17 significant digits that reads back as the
+        // same double, fmt's "{}" keeps only 6
+        inline std::string format_double(double value) {
+            std::string out = fmt::format("{:.15g}", value);
+
+            if (std::strtod(out.c_str(), nullptr) != value)
+                out = fmt::format("{:.17g}", value);
+
+            return out;
+        }
+
+        inline std::string url_encode(const std::string& s) {
+            static const char hex[] = "0123456789ABCDEF";
+            std::string out;
+
+            for (char ch : s) {
+                unsigned char c = static_cast<unsigned char>(ch);
+
+                if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+                    out.push_back(ch);
+                else {
+                    out.push_back('%');
+                    out.push_back(hex[c >> 4]);
+                    out.push_back(hex[c & 15]);
+                }
+            }
+
+            return out;
+        }
+
+        inline std::string base64_encode(const std::string& s) {
+            static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            std::string out;
+            size_t i = 0;
+
+            for (; i + 2 < s.size(); i += 3) {
+                uint32_t n = static_cast<uint32_t>(static_cast<unsigned char>(s[i])) << 16
+                             | static_cast<uint32_t>(static_cast<unsigned char>(s[i + 1])) << 8
+                             | static_cast<unsigned char>(s[i + 2]);
+                out.push_back(table[(n >> 18) & 63]);
+                out.push_back(table[(n >> 12) & 63]);
+                out.push_back(table[(n >> 6) & 63]);
+                out.push_back(table[n & 63]);
+            }
+
+            if (i < s.size()) {
+                uint32_t n = static_cast<uint32_t>(static_cast<unsigned char>(s[i])) << 16;
+
+                if (i + 1 < s.size())
+                    n |= static_cast<uint32_t>(static_cast<unsigned char>(s[i + 1])) << 8;
+
+                out.push_back(table[(n >> 18) & 63]);
+                out.push_back(table[(n >> 12) & 63]);
+                out.push_back(i + 1 < s.size() ? table[(n >> 6) & 63] : '=');
+                out.push_back('=');
+            }
+
+            return out;
+        }
+    }
+
+    inline std::string format_write_url(const std::string& base_url, const std::string& db, precision p,
+                                        const std::string& retention_policy = std::string()) {
+        std::string new_url(base_url);
+        new_url.append("/write?db=");
+        new_url.append(detail::url_encode(db));
+
+        if (!retention_policy.empty()) {
+            new_url.append("&rp=");
+            new_url.append(detail::url_encode(retention_policy));
+        }
+
+        // credentials are sent in an Authorization header by the
+        // transport so they stay out of URLs and logs
+
+        switch (p) {
+            case precision::nano:
+                new_url.append("&precision=n");
+                break;
+            case precision::micro:
+                new_url.append("&precision=u");
+                break;
+            case precision::milli:
+                new_url.append("&precision=ms");
+                break;
+            case precision::second:
+                new_url.append("&precision=s");
+                break;
+            case precision::minute:
+                new_url.append("&precision=m");
+                break;
+            case precision::hour:
+                new_url.append("&precision=h");
+                break;
+        }
+
+        return new_url;
+    }
+
+    // Write URL of the InfluxDB 2.x API. It has no minute or hour precision.
+    inline std::string format_write_url_v2(const std::string& base_url, const std::string& org,
+                                           const std::string& bucket, precision p) {
+        std::string new_url(base_url);
+        new_url.append("/api/v2/write?org=");
+        new_url.append(detail::url_encode(org));
+        new_url.append("&bucket=");
+        new_url.append(detail::url_encode(bucket));
+
+        switch (p) {
+            case precision::nano:
+                new_url.append("&precision=ns");
+                break;
+            case precision::micro:
+                new_url.append("&precision=us");
+                break;
+            case precision::milli:
+                new_url.append("&precision=ms");
+                break;
+            case precision::second:
+                new_url.append("&precision=s");
+                break;
+            case precision::minute:
+            case precision::hour:
+                throw std::invalid_argument("The v2 write API does not support minute or hour precision");
+        }
+
+        return new_url;
+    }
+
+    // Org, bucket and API token for writes through the InfluxDB 2.x API
+    struct v2_target {
+        std::string org;
+        std::string bucket;
+        std::string token;
+    };
+
+    // Tags written with every point of a client. Keys and values are escaped
+    // once when set and kept sorted by key, and the joined block is cached
+    // as bytes for points without tags of their own.
+    class tag_set {
+        public:
+            void set(const std::string& key, const std::string& value) {
+                std::string k = escape(key);
+                std::string tag = k + "=" + escape(value);
+                auto itr = find(k);
+
+                if (itr != tags.end() && itr->first == k)
+                    itr->second = std::move(tag);
+                else
+                    tags.emplace(itr, std::move(k), std::move(tag));
+
+                rebuild();
+            }
+
+            void remove(const std::string& key) {
+                std::string k = escape(key);
+                auto itr = find(k);
+
+                if (itr != tags.end() && itr->first == k) {
+                    tags.erase(itr);
+                    rebuild();
+                }
+            }
+
+            bool empty() const { return tags.empty(); }
+
+            // Changes whenever a tag is set or removed
+            uint64_t get_version() const { return version; }
+
+            // Escaped key and "key=value" of each tag, sorted by key
+            const std::vector<std::pair<std::string, std::string>>& entries() const { return tags; }
+
+            // Every tag with a leading comma, ready to follow the measurement
+            const std::string& block() const { return joined; }
+
+        private:
+            static std::string escape(const std::string& s) {
+                std::string out;
+                out.reserve(s.size());
+
+                for (char c : s) {
+                    if (c == ',' || c == '=' || c == ' ')
+                        out.push_back('\\');
+
+                    out.push_back(c);
+                }
+
+                return out;
+            }
+
+            std::vector<std::pair<std::string, std::string>>::iterator find(const std::string& key) {
+                return std::lower_bound(tags.begin(), tags.end(), key,
+                    [](const std::pair<std::string, std::string>& t, const std::string& k) { return t.first < k; });
+            }
+
+            void rebuild() {
+                joined.clear();
+                version++;
+
+                for (const auto& t : tags) {
+                    joined.push_back(',');
+                    joined.append(t.second);
+                }
+            }
+
+            std::vector<std::pair<std::string, std::string>> tags;
+            std::string joined;
+            uint64_t version = 0;
+    };
+
     class metric {
         public:
             metric(const std::string& measurement)
                 : measurement(measurement),
                 timestamp(std::chrono::system_clock::now()),
-                quote_re("\"") {}
+                quote_re("\""), prio(priority::normal), route(0) {}
 
             template<typename T>
             metric& add_tag(const std::string& key, const T& val) {
@@ -61,8 +315,31 @@ namespace influxdb {
                 return *this;
             }
 
+            // Overrides the creation time, e.g. to give metrics emitted
+            // together the same timestamp so they can be merged
+            metric& set_timestamp(std::chrono::system_clock::time_point t) {
+                timestamp = t;
+                return *this;
+            }
+
+            metric& set_priority(priority p) {
+                prio = p;
+                return *this;
+            }
+
+            // Sends the point to a destination added with add_destination(),
+            // route 0 is the one the client was created with
+            metric& set_route(size_t r) {
+                route = r;
+                return *this;
+            }
+
         private:
             uint64_t get_timestamp(precision p) {
+                return to_timestamp(timestamp, p);
+            }
+
+            static uint64_t to_timestamp(std::chrono::system_clock::time_point timestamp, precision p) {
                 using namespace std::chrono;
 
                 switch (p) {
@@ -83,19 +360,16 @@ namespace influxdb {
                 }
             }
 
-            std::string get_line(precision p) {
+            std::string get_line(precision p, const tag_set& defaults) {
                 fmt::MemoryWriter out;
-                out.write("{}", measurement);
-
-                for (const auto& tag : tags)
-                    out.write(",{}", tag);
+                write_series(out, defaults);
 
                 auto itr = fields.begin();
-                out.write(" {}", *itr);
+                out << ' ' << *itr;
                 itr++;
 
                 while (itr != fields.end()) {
-                    out.write(",{}", *itr);
+                    out << ',' << *itr;
                     itr++;
                 }
 
@@ -104,156 +378,2162 @@ namespace influxdb {
                 return out.str();
             }
 
+            // Measurement and tags, the part of the line that names the series
+            void write_series(fmt::MemoryWriter& out, const tag_set& defaults) const {
+                out << measurement;
+
+                if (defaults.empty()) {
+                    for (const auto& tag : tags)
+                        out << ',' << tag;
+                }
+                else if (tags.empty())
+                    out << defaults.block();
+                else
+                    write_merged_tags(out, defaults);
+            }
+
+            // Writes the point's tags and the defaults in key order, a tag
+            // of the point replaces a default with the same key
+            void write_merged_tags(fmt::MemoryWriter& out, const tag_set& defaults) const {
+                auto key = [](const std::string& tag) {
+                    size_t eq = tag.find('=');
+                    return fmt::StringRef(tag.data(), eq == std::string::npos ? tag.size() : eq);
+                };
+
+                std::vector<const std::string*> own;
+                own.reserve(tags.size());
+
+                for (const auto& tag : tags)
+                    own.push_back(&tag);
+
+                std::stable_sort(own.begin(), own.end(), [&](const std::string* a, const std::string* b) {
+                    return key(*a) < key(*b);
+                });
+
+                auto d = defaults.entries().begin();
+                auto d_end = defaults.entries().end();
+
+                for (const std::string* tag : own) {
+                    fmt::StringRef k = key(*tag);
+
+                    while (d != d_end && fmt::StringRef(d->first) < k) {
+                        out << ',' << d->second;
+                        ++d;
+                    }
+
+                    if (d != d_end && fmt::StringRef(d->first) == k)
+                        ++d;
+
+                    out << ',' << *tag;
+                }
+
+                for (; d != d_end; ++d)
+                    out << ',' << d->second;
+            }
+
             std::string measurement;
             std::vector<std::string> tags;
             std::vector<std::string> fields;
             std::chrono::system_clock::time_point timestamp;
             std::regex quote_re;
+            priority prio;
+            size_t route;
 
-            friend class influxdb_client;
+            friend class batching_client;
     };
 
-    class client {
-        public:
-            virtual ~client() {}
+    // Additive-increase/multiplicative-decrease tuning of the batch size.
+    // The target grows by increase_step after every healthy transfer and is
+    // scaled by decrease_factor after a timeout, 5xx, 429 or a transfer
+    // slower than latency_slo.
+    struct adaptive_batching {
+        size_t min_size = 2048;
+        size_t max_size = 1024 * 1024;
+        size_t increase_step = 4096;
+        double decrease_factor = 0.5;
+        std::chrono::milliseconds latency_slo = std::chrono::milliseconds(250);
+    };
 
-            virtual void update() {}
-            virtual void add_metric(metric& m) {}
-            virtual void write_metrics() {}
-            virtual bool is_active() { return false; }
+    // What to do with new batches once the queue of batches waiting to be
+    // sent is full
+    enum class backpressure : uint8_t {
+        drop_oldest,
+        drop_newest
     };
 
-    class dummy_client : public client {};
+    // Order of the lines within a batch. series_time groups the lines of
+    // each series and sorts them by timestamp, which the storage engine
+    // ingests and compacts more cheaply than interleaved series.
+    enum class batch_order : uint8_t {
+        arrival,
+        series_time
+    };
+
+    // Collection counters of one gauge callback. errors counts callbacks
+    // that threw or returned NaN or infinity, skipped counts collections
+    // that ran out of CPU budget before reaching the gauge.
+    struct gauge_stats {
+        uint64_t calls = 0;
+        uint64_t errors = 0;
+        uint64_t skipped = 0;
+        std::chrono::nanoseconds last_cpu = std::chrono::nanoseconds(0);
+        std::chrono::nanoseconds total_cpu = std::chrono::nanoseconds(0);
+    };
+
+    // Where a routed point is written. An empty retention_policy uses the
+    // database default.
+    struct destination {
+        std::string db;
+        std::string retention_policy;
+        precision ts_precision = precision::nano;
+    };
 
-    class influxdb_client : public client {
+    // Limits on outgoing writes, zero disables a limit. Batches that would
+    // exceed them wait in the pending queue, which is bounded by
+    // max_pending_bytes and shed according to the backpressure policy.
+    struct rate_limit {
+        double bytes_per_second = 0;
+        double points_per_second = 0;
+        double burst_seconds = 1.0;
+        size_t max_pending_bytes = 16 * 1024 * 1024;
+        backpressure policy = backpressure::drop_oldest;
+    };
+
+    // Batching and dispatch settings for one priority class. A batch_size of
+    // zero follows the client's batch target, a max_delay of zero only
+    // flushes on size and a max_in_flight of zero does not cap transfers.
+    struct lane_policy {
+        size_t batch_size = 0;
+        std::chrono::milliseconds max_delay = std::chrono::milliseconds(0);
+        size_t max_in_flight = 0;
+    };
+
+    // Failed writes caused by the network, a 5xx or a 429 are queued again
+    // up to max_retries times, waiting backoff * 2^(attempt - 1) first
+    struct retry_policy {
+        size_t max_retries = 0;
+        std::chrono::milliseconds backoff = std::chrono::milliseconds(100);
+    };
+
+    // The circuit opens after failure_threshold consecutive failed writes,
+    // zero disables it. After open_time a single probe write is let through
+    // and its outcome closes or reopens the circuit.
+    struct breaker_policy {
+        size_t failure_threshold = 0;
+        std::chrono::milliseconds open_time = std::chrono::milliseconds(5000);
+    };
+
+    // HTTP/2 lets concurrent batches share one connection as separate
+    // streams. http_2 negotiates it over TLS and keeps HTTP/1.1 for plain
+    // http URLs, http_2_prior_knowledge speaks cleartext HTTP/2 (h2c).
+    enum class http_version : uint8_t {
+        http_1_1,
+        http_2,
+        http_2_prior_knowledge
+    };
+
+    // Connection reuse settings for the multi handle. warm_connections are
+    // opened up front with a request to /ping and opened again whenever the
+    // client has been idle for keepalive_interval, zero disables that. The
+    // limits map to CURLMOPT_MAX_HOST_CONNECTIONS, CURLMOPT_MAX_TOTAL_CONNECTIONS
+    // and CURLMOPT_MAXCONNECTS, zero keeps the libcurl default.
+    struct connection_pool {
+        size_t warm_connections = 0;
+        std::chrono::milliseconds keepalive_interval = std::chrono::milliseconds(0);
+        long max_host_connections = 0;
+        long max_total_connections = 0;
+        long max_cached_connections = 0;
+    };
+
+    enum class circuit_state : uint8_t {
+        closed,
+        open,
+        half_open
+    };
+
+    class circuit_breaker {
         public:
-            influxdb_client(std::string url, std::string db, precision p,
-                            size_t buffer_size = 2048, bool save_failures = false)
-                : base_url(url), database(db), ts_precision(p),
-                  max_buffer(buffer_size), save_failures(save_failures),
-                  running_handles(0) {
-                mhandle = curl_multi_init();
+            circuit_breaker()
+                : state(circuit_state::closed), failures(0), trips(0), probing(false) {}
 
-                if (mhandle == nullptr)
-                    throw std::runtime_error("Failed to initialize curl multi interface");
+            void configure(const breaker_policy& config) { policy = config; }
+
+            // Whether a write may be attempted now, moves an open circuit to
+            // half open once open_time has passed and hands out the probe
+            bool allow(std::chrono::steady_clock::time_point now) {
+                if (policy.failure_threshold == 0)
+                    return true;
+
+                switch (state) {
+                    case circuit_state::closed:
+                        return true;
+                    case circuit_state::open:
+                        if (now - opened < policy.open_time)
+                            return false;
+
+                        state = circuit_state::half_open;
+                        probing = false;
+                        // fall through
+                    case circuit_state::half_open:
+                        if (probing)
+                            return false;
+
+                        probing = true;
+                        return true;
+                }
 
-                post_data.reserve(max_buffer);
-                write_url = format_write_url(base_url, database);
+                return true;
             }
 
-            ~influxdb_client() {
-                curl_multi_cleanup(mhandle);
+            void record_success() {
+                state = circuit_state::closed;
+                failures = 0;
+                probing = false;
             }
 
-            void update() final override {
-                CURLMcode rcode;
-                prev_running_handles = running_handles;
+            void record_failure(std::chrono::steady_clock::time_point now) {
+                failures++;
 
-                rcode = curl_multi_perform(mhandle, &running_handles);
+                if (policy.failure_threshold == 0)
+                    return;
 
-                if (rcode != CURLM_OK)
-                    throw std::runtime_error(curl_multi_strerror(rcode));
+                if (state == circuit_state::half_open
+                    || (state == circuit_state::closed && failures >= policy.failure_threshold)) {
+                    state = circuit_state::open;
+                    opened = now;
+                    probing = false;
+                    trips++;
+                }
+            }
 
-                if (running_handles < prev_running_handles) {
-                    // remove any completed transfers
-                    // and store errors
-                    do {
-                        int msgq;
-                        cmsg = curl_multi_info_read(mhandle, &msgq);
+            circuit_state get_state() const { return state; }
+            size_t get_consecutive_failures() const { return failures; }
+            uint64_t get_trips() const { return trips; }
 
-                        if (cmsg != nullptr && (cmsg->msg == CURLMSG_DONE)) {
-                            CURL* handle = cmsg->easy_handle;
+            // How long until an open circuit lets a probe through
+            std::chrono::microseconds wait_time(std::chrono::steady_clock::time_point now) const {
+                if (state != circuit_state::open || now - opened >= policy.open_time)
+                    return std::chrono::microseconds(0);
 
-                            if (save_failures && cmsg->data.result != CURLE_OK)
-                                failed_transfers.push_back(curl_easy_strerror(cmsg->data.result));
+                return std::chrono::duration_cast<std::chrono::microseconds>(policy.open_time - (now - opened));
+            }
 
-                            curl_multi_remove_handle(mhandle, handle);
-                            curl_easy_cleanup(handle);
-                        }
-                    } while (cmsg != nullptr);
-                }
+        private:
+            breaker_policy policy;
+            circuit_state state;
+            size_t failures;
+            uint64_t trips;
+            bool probing;
+            std::chrono::steady_clock::time_point opened;
+    };
+
+    class token_bucket {
+        public:
+            token_bucket() : rate(0), capacity(0), tokens(0) {}
+
+            token_bucket(double rate, double burst_seconds)
+                : rate(rate), capacity(rate * burst_seconds), tokens(capacity),
+                  refilled(std::chrono::steady_clock::now()) {}
+
+            bool enabled() const { return rate > 0; }
+
+            // Requests larger than the bucket are let through once it is
+            // full and put it into debt, so any batch size eventually passes
+            bool can_consume(double n, std::chrono::steady_clock::time_point now) {
+                refill(now);
+                return tokens >= std::min(n, capacity);
             }
 
-            void add_metric(metric& m) final override {
-                post_data.append(m.get_line(ts_precision));
+            void consume(double n) { tokens -= n; }
+
+            // How long until can_consume(n) would succeed
+            std::chrono::microseconds wait_time(double n) const {
+                double missing = std::min(n, capacity) - tokens;
+
+                if (missing <= 0)
+                    return std::chrono::microseconds(0);
 
-                if (post_data.size() >= max_buffer)
-                    write_metrics();
+                return std::chrono::microseconds(static_cast<int64_t>(missing / rate * 1e6) + 1);
             }
 
-            void write_metrics() final override {
-                CURL* ehandle = curl_easy_init();
+        private:
+            void refill(std::chrono::steady_clock::time_point now) {
+                std::chrono::duration<double> elapsed = now - refilled;
+                refilled = now;
+                tokens = std::min(capacity, tokens + elapsed.count() * rate);
+            }
 
-                if (ehandle) {
-                    curl_easy_setopt(ehandle, CURLOPT_URL, &write_url[0]);
-                    curl_easy_setopt(ehandle, CURLOPT_POSTFIELDSIZE, post_data.size());
-                    curl_easy_setopt(ehandle, CURLOPT_COPYPOSTFIELDS, &post_data[0]);
+            double rate;
+            double capacity;
+            double tokens;
+            std::chrono::steady_clock::time_point refilled;
+    };
 
-                    running_handles++;
-                    CURLMcode rcode = curl_multi_add_handle(mhandle, ehandle);
+    // Space-saving summary (Metwally et al.) of the most frequent values of
+    // a stream. capacity counters are kept in buckets of equal count, so
+    // counting a value is a hash lookup and a move to the neighbouring
+    // bucket; an unmonitored value replaces one with the lowest count. Up
+    // to k values are marked as heavy hitters once their guaranteed count
+    // exceeds that lowest count, and stay marked until they are replaced.
+    class heavy_hitters {
+        public:
+            explicit heavy_hitters(size_t k, size_t capacity = 0)
+                : k(k), capacity(capacity > 0 ? capacity : 4 * k), first(none), marked(0), folded(0) {
+                if (k == 0 || this->capacity < k)
+                    throw std::invalid_argument("heavy_hitters needs 0 < k <= capacity");
 
-                    if (rcode != CURLM_OK)
-                        throw std::runtime_error(curl_multi_strerror(rcode));
+                counters.reserve(this->capacity);
+                buckets.reserve(this->capacity + 1);
+            }
 
-                    post_data.clear();
+            // Counts value and returns whether it is one of the heavy hitters
+            bool offer(const char* data, size_t size) {
+                key.assign(data, size);
+                auto it = index.find(key);
+                size_t i;
+
+                if (it != index.end()) {
+                    i = it->second;
+                    increment(i);
                 }
-                else
-                    throw std::runtime_error("Failed to initialize curl easy handle");
+                else if (counters.size() < capacity) {
+                    i = counters.size();
+                    counters.push_back(counter());
+                    counters[i].value = key;
+
+                    if (first == none || buckets[first].count != 1)
+                        add_bucket(1, none);
+
+                    link(i, first);
+                    counters[i].count = 1;
+                    index.emplace(key, i);
+                }
+                else {
+                    // replace the oldest value with the lowest count
+                    i = buckets[first].head;
+                    counter& c = counters[i];
+                    index.erase(c.value);
+
+                    if (c.heavy)
+                        marked--;
+
+                    c.value = key;
+                    c.error = c.count;
+                    c.heavy = false;
+                    increment(i);
+                    index.emplace(key, i);
+                }
+
+                counter& c = counters[i];
+
+                // while no value has been replaced every count is exact
+                uint64_t floor = counters.size() < capacity ? 1 : buckets[first].count;
+
+                if (!c.heavy && marked < k && c.count - c.error > floor) {
+                    c.heavy = true;
+                    marked++;
+                }
+
+                if (!c.heavy)
+                    folded++;
+
+                return c.heavy;
             }
 
-            bool is_active() final override {
-                return running_handles > 0;
+            bool offer(const std::string& value) {
+                return offer(value.data(), value.size());
             }
 
-            const std::vector<std::string>& get_failures() { return failed_transfers; }
-            void clear_failures() { failed_transfers.clear(); }
+            // The heavy hitters with their estimated counts, most frequent first
+            std::vector<std::pair<std::string, uint64_t>> top() const {
+                std::vector<std::pair<std::string, uint64_t>> result;
+
+                for (const auto& c : counters) {
+                    if (c.heavy)
+                        result.emplace_back(c.value, c.count);
+                }
+
+                std::sort(result.begin(), result.end(), [](const std::pair<std::string, uint64_t>& a,
+                                                           const std::pair<std::string, uint64_t>& b) {
+                    return a.second > b.second;
+                });
+
+                return result;
+            }
+
+            // Values that were not heavy hitters when they were counted
+            uint64_t get_folded() const { return folded; }
 
         private:
-            std::string format_write_url(const std::string& base_url, const std::string& db) {
-                std::string new_url(base_url);
-                new_url.append("/write?db=");
-                new_url.append(db);
+            static const size_t none = static_cast<size_t>(-1);
 
-                // TODO handle authentication
+            struct counter {
+                std::string value;
+                uint64_t count = 0;
+                uint64_t error = 0;
+                bool heavy = false;
+                size_t bucket = none;
+                size_t prev = none;
+                size_t next = none;
+            };
 
-                switch (ts_precision) {
-                    case precision::nano:
-                        new_url.append("&precision=n");
-                        break;
-                    case precision::micro:
-                        new_url.append("&precision=u");
-                        break;
-                    case precision::milli:
-                        new_url.append("&precision=ms");
-                        break;
-                    case precision::second:
-                        new_url.append("&precision=s");
-                        break;
-                    case precision::minute:
-                        new_url.append("&precision=m");
-                        break;
-                    case precision::hour:
-                        new_url.append("&precision=h");
-                        break;
+            // counters with the same count, oldest first, in a list of
+            // buckets ordered by count
+            struct bucket {
+                uint64_t count = 0;
+                size_t head = none;
+                size_t tail = none;
+                size_t prev = none;
+                size_t next = none;
+            };
+
+            void increment(size_t i) {
+                size_t b = counters[i].bucket;
+                uint64_t count = counters[i].count + 1;
+                size_t next = buckets[b].next;
+
+                if (next == none || buckets[next].count != count)
+                    next = add_bucket(count, b);
+
+                unlink(i);
+                link(i, next);
+                counters[i].count = count;
+
+                if (buckets[b].head == none)
+                    remove_bucket(b);
+            }
+
+            void link(size_t i, size_t b) {
+                counter& c = counters[i];
+                c.bucket = b;
+                c.prev = buckets[b].tail;
+                c.next = none;
+
+                if (c.prev != none)
+                    counters[c.prev].next = i;
+                else
+                    buckets[b].head = i;
+
+                buckets[b].tail = i;
+            }
+
+            void unlink(size_t i) {
+                counter& c = counters[i];
+                bucket& b = buckets[c.bucket];
+
+                if (c.prev != none)
+                    counters[c.prev].next = c.next;
+                else
+                    b.head = c.next;
+
+                if (c.next != none)
+                    counters[c.next].prev = c.prev;
+                else
+                    b.tail = c.prev;
+            }
+
+            // Inserts a bucket after prev, or first when prev is none
+            size_t add_bucket(uint64_t count, size_t prev) {
+                size_t b;
+
+                if (!free_buckets.empty()) {
+                    b = free_buckets.back();
+                    free_buckets.pop_back();
+                    buckets[b] = bucket();
+                }
+                else {
+                    b = buckets.size();
+                    buckets.push_back(bucket());
                 }
 
-                return new_url;
+                size_t next = prev == none ? first : buckets[prev].next;
+                buckets[b].count = count;
+                buckets[b].prev = prev;
+                buckets[b].next = next;
+
+                if (next != none)
+                    buckets[next].prev = b;
+
+                if (prev != none)
+                    buckets[prev].next = b;
+                else
+                    first = b;
+
+                return b;
             }
 
-            std::string base_url;
-            std::string write_url;
-            std::string database;
-            precision ts_precision;
+            void remove_bucket(size_t b) {
+                size_t prev = buckets[b].prev;
+                size_t next = buckets[b].next;
 
-            CURLM* mhandle;
-            CURLMsg* cmsg;
-            size_t max_buffer;
-            std::string post_data;
-            std::vector<std::string> failed_transfers;
-            bool save_failures;
+                if (prev != none)
+                    buckets[prev].next = next;
+                else
+                    first = next;
 
-            int running_handles;
-            int prev_running_handles;
+                if (next != none)
+                    buckets[next].prev = prev;
+
+                free_buckets.push_back(b);
+            }
+
+            size_t k;
+            size_t capacity;
+            std::vector<counter> counters;
+            std::vector<bucket> buckets;
+            std::vector<size_t> free_buckets;
+            size_t first;
+            std::unordered_map<std::string, size_t> index;
+            std::string key;
+            size_t marked;
+            uint64_t folded;
+    };
+
+    class client {
+        public:
+            virtual ~client() {}
+
+            virtual void update() {}
+            virtual void add_metric(metric& m) {}
+            virtual void write_metrics() {}
+            virtual bool is_active() { return false; }
+    };
+
+    class dummy_client : public client {};
+
+    // Outcome of one batch handed to a transport. status is the HTTP status
+    // for HTTP transports and zero otherwise, error is empty on success.
+    // Transient failures are worth retrying, anything else is final.
+    struct completion {
+        uint64_t id = 0;
+        long status = 0;
+        std::string error;
+        bool transient = false;
+        bool timed_out = false;
+
+        bool delivered() const {
+            return error.empty() && (status == 0 || (status >= 200 && status < 300));
+        }
+    };
+
+    // Moves finished batches to their destination. Batching, retries and
+    // flow control live in batching_client, a transport only does the I/O.
+    class transport {
+        public:
+            virtual ~transport() {}
+
+            // Starts delivering a batch. The body stays alive and unchanged
+            // until the completion with the same id has been reported.
+            virtual void send(uint64_t id, const std::string& body) = 0;
+            // Drives I/O without blocking and appends finished sends to done
+            virtual void poll(std::vector<completion>& done) = 0;
+            // Blocks until there is I/O to drive or the timeout passes
+            virtual void wait(std::chrono::milliseconds timeout) = 0;
+            // Abandons every send in flight without reporting it
+            virtual void cancel() = 0;
+            // Whether poll() still has I/O to drive
+            virtual bool is_busy() const = 0;
+            // Periodic housekeeping, called from every update()
+            virtual void maintain() {}
+            // Called once after each round of send() calls, so a transport
+            // that queues sends can start them all with one syscall
+            virtual void flush() {}
+
+            // Registers another write destination and returns its route for
+            // send_to(). Route 0 is the destination the transport was
+            // created with.
+            virtual size_t add_route(const destination&) {
+                throw std::runtime_error("This transport does not support routing");
+            }
+
+            // send() to the destination of a route
+            virtual void send_to(size_t route, uint64_t id, const std::string& body) {
+                if (route != 0)
+                    throw std::runtime_error("This transport does not support routing");
+
+                send(id, body);
+            }
+    };
+
+    namespace detail {
+        // Position and sort key of one line of a batch. The timestamp has
+        // its sign bit flipped so that it sorts as an unsigned number.
+        struct line_ref {
+            uint64_t series;
+            uint64_t time;
+            size_t offset;
+            size_t length;
+            size_t key_length;
+            size_t fields_end;
+        };
+
+        // 64-bit FNV-1a
+        inline uint64_t hash_bytes(const char* s, size_t n) {
+            uint64_t h = 14695981039346656037ULL;
+
+            for (size_t i = 0; i < n; i++) {
+                h ^= static_cast<unsigned char>(s[i]);
+                h *= 1099511628211ULL;
+            }
+
+            return h;
+        }
+
+        // Splits a batch into lines and computes the series hash and
+        // timestamp of each, a line without a timestamp gets time 0
+        inline void index_lines(const std::string& body, std::vector<line_ref>& lines) {
+            const uint64_t sign = 1ULL << 63;
+            lines.clear();
+            size_t start = 0;
+
+            while (start < body.size()) {
+                size_t eol = body.find('\n', start);
+                size_t end = eol == std::string::npos ? body.size() : eol;
+                const char* p = body.data() + start;
+                size_t n = end - start;
+
+                if (n > 0) {
+                    // the series key runs up to the first unescaped space
+                    size_t key = 0;
+
+                    while (key < n && p[key] != ' ')
+                        key += p[key] == '\\' ? 2 : 1;
+
+                    key = std::min(key, n);
+
+                    line_ref l;
+                    l.series = hash_bytes(p, key);
+                    l.time = sign;
+                    l.offset = start;
+                    l.length = n;
+                    l.key_length = key;
+                    l.fields_end = n;
+
+                    size_t last = n;
+
+                    while (last > key && p[last - 1] != ' ')
+                        last--;
+
+                    if (last > key + 1 && last < n) {
+                        bool negative = p[last] == '-';
+                        uint64_t value = 0;
+                        size_t i = last + negative;
+
+                        while (i < n && p[i] >= '0' && p[i] <= '9')
+                            value = value * 10 + static_cast<uint64_t>(p[i++] - '0');
+
+                        if (i == n && i > last + negative) {
+                            l.time = (negative ? 0 - value : value) ^ sign;
+                            l.fields_end = last - 1;
+                        }
+                    }
+
+                    lines.push_back(l);
+                }
+
+                start = end + 1;
+            }
+        }
+
+        // Stable LSD radix sort by series hash, then time, one byte per
+        // pass. A pass is skipped when every line has the same byte there,
+        // which holds for most timestamp bytes within a batch.
+        inline void radix_sort(std::vector<line_ref>& lines, std::vector<line_ref>& scratch) {
+            std::vector<size_t> counts(16 * 256);
+
+            for (const auto& l : lines) {
+                for (size_t b = 0; b < 8; b++) {
+                    counts[b * 256 + ((l.time >> (b * 8)) & 0xff)]++;
+                    counts[(8 + b) * 256 + ((l.series >> (b * 8)) & 0xff)]++;
+                }
+            }
+
+            scratch.resize(lines.size());
+
+            for (size_t pass = 0; pass < 16; pass++) {
+                size_t* count = &counts[pass * 256];
+                size_t shift = (pass % 8) * 8;
+                auto digit = [&](const line_ref& l) {
+                    return ((pass < 8 ? l.time : l.series) >> shift) & 0xff;
+                };
+
+                if (count[digit(lines[0])] == lines.size())
+                    continue;
+
+                size_t sum = 0;
+
+                for (size_t i = 0; i < 256; i++) {
+                    size_t c = count[i];
+                    count[i] = sum;
+                    sum += c;
+                }
+
+                for (const auto& l : lines)
+                    scratch[count[digit(l)]++] = l;
+
+                lines.swap(scratch);
+            }
+        }
+
+        // Appends the key of every field in a field set
+        inline void field_keys(const char* p, size_t n, std::vector<std::pair<const char*, size_t>>& keys) {
+            size_t i = 0;
+
+            while (i < n) {
+                size_t key = i;
+
+                while (i < n && p[i] != '=')
+                    i += p[i] == '\\' ? 2 : 1;
+
+                keys.emplace_back(p + key, std::min(i, n) - key);
+                i++;
+
+                // skip the value, string values may contain commas
+                if (i < n && p[i] == '"') {
+                    i++;
+
+                    while (i < n && p[i] != '"')
+                        i += p[i] == '\\' ? 2 : 1;
+                }
+
+                while (i < n && p[i] != ',')
+                    i++;
+
+                i++;
+            }
+        }
+
+        // Merges lines that share series key and timestamp into one line
+        // with the fields of all of them, at the position of the first. A
+        // line that repeats a field already in the merged line starts a new
+        // one instead, so the server still sees the later value last.
+        // Returns the number of lines left.
+        inline size_t merge_lines(std::string& body, std::vector<line_ref>& lines,
+                                  std::unordered_map<uint64_t, size_t>& groups) {
+            index_lines(body, lines);
+            groups.clear();
+
+            const size_t none = static_cast<size_t>(-1);
+            std::vector<size_t> next(lines.size(), none);
+            std::vector<size_t> tail(lines.size(), none);
+            std::vector<bool> merged(lines.size(), false);
+            std::vector<std::pair<const char*, size_t>> keys;
+            size_t remaining = lines.size();
+            const char* data = body.data();
+
+            auto fields = [&](const line_ref& l) {
+                return std::make_pair(data + l.offset + l.key_length + 1,
+                                      l.fields_end - std::min(l.fields_end, l.key_length + 1));
+            };
+
+            for (size_t i = 0; i < lines.size(); i++) {
+                const line_ref& l = lines[i];
+                uint64_t h = l.series ^ (l.time * 0x9E3779B97F4A7C15ULL);
+                auto itr = groups.find(h);
+
+                if (itr == groups.end()) {
+                    groups.emplace(h, i);
+                    tail[i] = i;
+                    continue;
+                }
+
+                size_t head = itr->second;
+                const line_ref& first = lines[head];
+                bool same = first.time == l.time && first.key_length == l.key_length
+                            && std::memcmp(data + first.offset, data + l.offset, l.key_length) == 0;
+
+                if (same) {
+                    keys.clear();
+
+                    for (size_t k = head; k != none; k = next[k]) {
+                        auto f = fields(lines[k]);
+                        field_keys(f.first, f.second, keys);
+                    }
+
+                    size_t existing = keys.size();
+                    auto f = fields(l);
+                    field_keys(f.first, f.second, keys);
+
+                    for (size_t a = existing; same && a < keys.size(); a++) {
+                        for (size_t b = 0; same && b < existing; b++) {
+                            same = keys[a].second != keys[b].second
+                                   || std::memcmp(keys[a].first, keys[b].first, keys[a].second) != 0;
+                        }
+                    }
+                }
+
+                if (!same) {
+                    itr->second = i;
+                    tail[i] = i;
+                    continue;
+                }
+
+                next[tail[head]] = i;
+                tail[head] = i;
+                merged[i] = true;
+                remaining--;
+            }
+
+            if (remaining == lines.size())
+                return remaining;
+
+            std::string out;
+            out.reserve(body.size());
+
+            for (size_t i = 0; i < lines.size(); i++) {
+                if (merged[i])
+                    continue;
+
+                const line_ref& l = lines[i];
+                out.append(body, l.offset, l.fields_end);
+
+                for (size_t k = next[i]; k != none; k = next[k]) {
+                    auto f = fields(lines[k]);
+                    out.push_back(',');
+                    out.append(f.first, f.second);
+                }
+
+                out.append(body, l.offset + l.fields_end, l.length - l.fields_end);
+                out.push_back('\n');
+            }
+
+            body.swap(out);
+            return remaining;
+        }
+
+        // Rewrites a batch with its lines grouped by series and in time
+        // order within each series. Series are grouped by hash, so their
+        // order relative to each other is arbitrary.
+        inline void sort_batch(std::string& body, std::vector<line_ref>& lines, std::vector<line_ref>& scratch) {
+            index_lines(body, lines);
+
+            if (lines.size() < 2)
+                return;
+
+            radix_sort(lines, scratch);
+
+            std::string sorted;
+            sorted.reserve(body.size());
+
+            for (const auto& l : lines) {
+                sorted.append(body, l.offset, l.length);
+                sorted.push_back('\n');
+            }
+
+            body.swap(sorted);
+        }
+    }
+
+    // The batching pipeline shared by every transport: per priority lane
+    // buffers, adaptive sizing, rate limiting, backpressure, retries, the
+    // circuit breaker and spilling of undelivered data.
+    class batching_client : public client {
+        public:
+            batching_client(std::unique_ptr<transport> output, precision p,
+                            size_t buffer_size = 2048, bool save_failures = false)
+                : output(std::move(output)),
+                  max_buffer(buffer_size), save_failures(save_failures), next_id(0),
+                  adaptive(false), batch_target(buffer_size), last_latency(0),
+                  order(batch_order::arrival), merge(false), pending_bytes(0), dropped_points(0),
+                  dropped_bytes(0), drain_on_destroy(false), gauge_interval(10000), gauge_budget(0),
+                  next_gauge(0) {
+                if (!this->output)
+                    throw std::invalid_argument("batching_client needs a transport");
+
+                add_lanes(p);
+            }
+
+            ~batching_client() {
+                if (drain_on_destroy) {
+                    try {
+                        shutdown(drain_deadline);
+                    }
+                    catch (...) {}
+                }
+
+                abort_transfers();
+            }
+
+            void update() final override {
+                output->poll(completed);
+
+                INFLUXDB_PROBE(update, completed.size(), transfers.size(), pending_bytes);
+
+                for (const auto& c : completed) {
+                    if (adaptive)
+                        adapt_batch_target(c);
+
+                    complete(c);
+                }
+
+                completed.clear();
+
+                if (!gauges.empty() && gauge_interval.count() > 0
+                    && std::chrono::steady_clock::now() - last_gauge_collection >= gauge_interval)
+                    collect_gauges();
+
+                flush_expired_lanes();
+                dispatch();
+                output->maintain();
+            }
+
+            void add_metric(metric& m) final override {
+                if (m.route >= route_precision.size())
+                    throw std::invalid_argument("Metric has an unknown route");
+
+                size_t index = m.route * priorities + static_cast<size_t>(m.prio);
+
+                if (tag_limits.empty()) {
+                    append_line(index, m.get_line(route_precision[m.route], default_tags));
+                    return;
+                }
+
+                // tags folded by a limit are swapped in only for formatting
+                fold_tags(m);
+                std::string line;
+
+                try {
+                    line = m.get_line(route_precision[m.route], default_tags);
+                }
+                catch (...) {
+                    restore_tags();
+                    throw;
+                }
+
+                restore_tags();
+
+                append_line(index, line);
+            }
+
+            // Writes a point whose field set is already in line protocol,
+            // such as "a=1i,b=2.5", with the series, priority and route of
+            // point and the given time
+            void add_fields(const metric& point, const std::string& fields, std::chrono::system_clock::time_point t) {
+                if (point.route >= route_precision.size())
+                    throw std::invalid_argument("Metric has an unknown route");
+                if (fields.empty())
+                    throw std::invalid_argument("Point needs at least one field");
+
+                fmt::MemoryWriter out;
+                point.write_series(out, default_tags);
+                out << ' ' << fields;
+                out.write(" {}\n", metric::to_timestamp(t, route_precision[point.route]));
+
+                append_line(point.route * priorities + static_cast<size_t>(point.prio), out.str());
+            }
+
+            void write_metrics() final override {
+                for (size_t i = 0; i < lanes.size(); i++)
+                    flush_lane(i);
+
+                dispatch();
+            }
+
+            bool is_active() final override {
+                return !transfers.empty() || pending_bytes > 0 || output->is_busy();
+            }
+
+            const std::vector<std::string>& get_failures() { return failed_transfers; }
+            void clear_failures() { failed_transfers.clear(); }
+
+            // Flushes the pending batches and keeps driving transfers until
+            // they all finish or the deadline passes. Whatever is left is
+            // handed to the spill sink. Returns true if nothing was left over.
+            bool shutdown(std::chrono::milliseconds deadline) {
+                using namespace std::chrono;
+                auto expires = steady_clock::now() + deadline;
+
+                write_metrics();
+                update();
+
+                while (is_active()) {
+                    auto remaining = duration_cast<milliseconds>(expires - steady_clock::now());
+
+                    if (remaining.count() <= 0)
+                        break;
+
+                    if (!output->is_busy()) {
+                        // only delayed batches are left, nothing to poll
+                        std::this_thread::sleep_for(std::min<microseconds>(remaining, dispatch_wait()));
+                    }
+                    else
+                        output->wait(remaining);
+
+                    update();
+                }
+
+                return abort_transfers() == 0;
+            }
+
+            // Receives the line protocol of any batch that could not be
+            // delivered: shed by backpressure, out of retries, or still
+            // queued when the client went away
+            void set_spill_sink(std::function<void(const std::string&)> sink) {
+                spill_sink = std::move(sink);
+            }
+
+            // Makes the destructor call shutdown() with the given deadline
+            void set_drain_on_destroy(std::chrono::milliseconds deadline) {
+                drain_on_destroy = true;
+                drain_deadline = deadline;
+            }
+
+            // Replaces the fixed buffer size with a target that follows the
+            // observed write latency and server responses
+            void enable_adaptive_batching(const adaptive_batching& config) {
+                if (config.min_size == 0 || config.min_size > config.max_size)
+                    throw std::invalid_argument("Invalid adaptive batch size range");
+
+                if (config.decrease_factor <= 0.0 || config.decrease_factor >= 1.0)
+                    throw std::invalid_argument("Adaptive batch decrease factor must be in (0, 1)");
+
+                adaptive = true;
+                aimd = config;
+                batch_target = std::min(std::max(max_buffer, aimd.min_size), aimd.max_size);
+                last_decrease = std::chrono::steady_clock::now();
+            }
+
+            // Registers a value that is read when gauges are collected rather
+            // than pushed on every change. point supplies the measurement,
+            // tags, priority and route and field names the value. Returns
+            // the id for remove_gauge() and get_gauge_stats().
+            size_t add_gauge(const metric& point, const std::string& field, std::function<double()> callback) {
+                if (point.route >= route_precision.size())
+                    throw std::invalid_argument("Gauge has an unknown route");
+                if (!callback)
+                    throw std::invalid_argument("Gauge needs a callback");
+
+                gauges.emplace_back(new gauge(point, field));
+                gauges.back()->value = std::move(callback);
+                return gauges.size() - 1;
+            }
+
+            // Like add_gauge() for a callback that appends a whole field
+            // set, such as "a=1i,b=2.5", for the point's series. Writing
+            // nothing skips the point for that collection.
+            size_t add_collector(const metric& point, std::function<void(std::string&)> write_fields) {
+                if (point.route >= route_precision.size())
+                    throw std::invalid_argument("Collector has an unknown route");
+                if (!write_fields)
+                    throw std::invalid_argument("Collector needs a callback");
+
+                gauges.emplace_back(new gauge(point, std::string()));
+                gauges.back()->fields = std::move(write_fields);
+                return gauges.size() - 1;
+            }
+
+            void remove_gauge(size_t id) {
+                if (id < gauges.size())
+                    gauges[id].reset();
+            }
+
+            // Collects the gauges from update() every interval, zero leaves
+            // it to collect_gauges(). A nonzero cpu_budget caps the CPU time
+            // of one collection; gauges it did not reach go first next time.
+            void set_gauge_interval(std::chrono::milliseconds interval,
+                                    std::chrono::microseconds cpu_budget = std::chrono::microseconds(0)) {
+                gauge_interval = interval;
+                gauge_budget = cpu_budget;
+            }
+
+            // Calls the gauge callbacks and writes their values into the
+            // current batches
+            void collect_gauges() {
+                auto now = std::chrono::system_clock::now();
+                size_t start = next_gauge < gauges.size() ? next_gauge : 0;
+                std::chrono::nanoseconds used(0);
+                bool exhausted = false;
+
+                next_gauge = start;
+
+                for (size_t k = 0; k < gauges.size(); k++) {
+                    size_t i = (start + k) % gauges.size();
+                    gauge* g = gauges[i].get();
+
+                    if (g == nullptr)
+                        continue;
+
+                    if (!exhausted && gauge_budget.count() > 0 && used >= gauge_budget) {
+                        exhausted = true;
+                        next_gauge = i;
+                    }
+
+                    if (exhausted) {
+                        g->stats.skipped++;
+                        continue;
+                    }
+
+                    used += collect_gauge(*g, now);
+                }
+
+                last_gauge_collection = std::chrono::steady_clock::now();
+            }
+
+            const gauge_stats& get_gauge_stats(size_t id) const {
+                if (id >= gauges.size() || !gauges[id])
+                    throw std::out_of_range("Unknown gauge");
+
+                return gauges[id]->stats;
+            }
+
+            // Adds a tag to every point, a tag of the point itself with the
+            // same key takes precedence. Tags are written sorted by key.
+            void set_default_tag(const std::string& key, const std::string& value) {
+                default_tags.set(key, value);
+            }
+
+            void remove_default_tag(const std::string& key) {
+                default_tags.remove(key);
+            }
+
+            // Reorders the lines of each batch before it is queued
+            void set_batch_order(batch_order o) {
+                order = o;
+            }
+
+            // Combines lines of a batch that have the same measurement, tags
+            // and timestamp into a single line before it is queued
+            void set_line_merging(bool enabled) {
+                merge = enabled;
+            }
+
+            // Throttles batch dispatch to the given bytes and points per second
+            void set_rate_limit(const rate_limit& config) {
+                limits = config;
+                byte_bucket = token_bucket(config.bytes_per_second, config.burst_seconds);
+                point_bucket = token_bucket(config.points_per_second, config.burst_seconds);
+            }
+
+            void set_retry_policy(const retry_policy& config) {
+                retries = config;
+            }
+
+            // While the circuit is open batches stay queued for retry instead
+            // of attempting connections to a server that is down
+            void set_circuit_breaker(const breaker_policy& config) {
+                breaker.configure(config);
+            }
+
+            const circuit_breaker& get_circuit_breaker() const { return breaker; }
+
+            // Overrides the batching and dispatch settings of one priority class
+            void set_lane_policy(priority p, const lane_policy& policy) {
+                for (size_t i = static_cast<size_t>(p); i < lanes.size(); i += priorities)
+                    lanes[i].policy = policy;
+            }
+
+            // Adds a destination with its own batches and returns the route
+            // to pass to metric::set_route(). Routes share the transport and
+            // its connections, and follow the same lane policies.
+            size_t add_destination(const destination& d) {
+                size_t route = output->add_route(d);
+
+                if (route != route_precision.size())
+                    throw std::logic_error("Transport returned an unexpected route");
+
+                add_lanes(d.ts_precision);
+                return route;
+            }
+
+            // Writes only the k most frequent values of tag key as their own
+            // series of measurement and every other value as other_value,
+            // so a tag such as a customer id keeps a flat number of series.
+            // Frequencies come from a space-saving summary of 4 * k values.
+            void set_tag_limit(const std::string& measurement, const std::string& key, size_t k,
+                               const std::string& other_value = "other") {
+                auto& limits = tag_limits[measurement];
+
+                for (auto& l : limits) {
+                    if (l->prefix == key + "=") {
+                        l.reset(new tag_limit(key, k, other_value));
+                        return;
+                    }
+                }
+
+                limits.emplace_back(new tag_limit(key, k, other_value));
+            }
+
+            const heavy_hitters& get_tag_limit(const std::string& measurement, const std::string& key) const {
+                auto it = tag_limits.find(measurement);
+
+                if (it != tag_limits.end()) {
+                    for (const auto& l : it->second) {
+                        if (l->prefix == key + "=")
+                            return l->hitters;
+                    }
+                }
+
+                throw std::out_of_range("No limit on this tag");
+            }
+
+            // Routes are numbered from 0 up to this count
+            size_t get_route_count() const { return route_precision.size(); }
+
+            // Data shed by the backpressure policy
+            uint64_t get_dropped_points() const { return dropped_points; }
+            uint64_t get_dropped_bytes() const { return dropped_bytes; }
+            // Bytes of finished batches waiting to be sent
+            size_t get_pending_bytes() const { return pending_bytes; }
+
+            // Current batch size in bytes that triggers a write
+            size_t get_batch_target() const { return batch_target; }
+            // Duration of the most recently completed transfer
+            std::chrono::milliseconds get_last_latency() const { return last_latency; }
+
+            transport& get_transport() { return *output; }
+
+        private:
+            struct batch {
+                std::string body;
+                size_t points = 0;
+                size_t lane = 0;
+                size_t attempts = 0;
+                std::chrono::steady_clock::time_point not_before;
+            };
+
+            struct lane {
+                size_t rank = 0;
+                std::string post_data;
+                size_t post_points = 0;
+                std::chrono::steady_clock::time_point first_point;
+                std::deque<batch> pending;
+                size_t in_flight = 0;
+                lane_policy policy;
+            };
+
+            struct transfer {
+                batch data;
+                std::chrono::steady_clock::time_point started;
+            };
+
+            struct gauge {
+                gauge(const metric& point, const std::string& field)
+                    : point(point), field(field), tags_version(0) {}
+
+                metric point;
+                std::string field;
+                // either a single value or a callback writing the field set
+                std::function<double()> value;
+                std::function<void(std::string&)> fields;
+                // the line up to the value, rebuilt when default tags change
+                std::string prefix;
+                uint64_t tags_version;
+                gauge_stats stats;
+            };
+
+            struct tag_limit {
+                tag_limit(const std::string& key, size_t k, const std::string& other_value)
+                    : prefix(key + "="), other(prefix + other_value), hitters(k) {}
+
+                std::string prefix;
+                std::string other;
+                heavy_hitters hitters;
+            };
+
+            // Swaps each limited tag that is not a heavy hitter with its
+            // other value and records the swaps in folded_tags
+            void fold_tags(metric& m) {
+                folded_tags.clear();
+                auto it = tag_limits.find(m.measurement);
+
+                if (it == tag_limits.end())
+                    return;
+
+                for (auto& l : it->second) {
+                    for (auto& tag : m.tags) {
+                        if (tag.compare(0, l->prefix.size(), l->prefix) != 0)
+                            continue;
+
+                        const char* value = tag.data() + l->prefix.size();
+
+                        if (!l->hitters.offer(value, tag.size() - l->prefix.size())) {
+                            tag.swap(l->other);
+                            folded_tags.emplace_back(&tag, &l->other);
+                        }
+
+                        break;
+                    }
+                }
+            }
+
+            void restore_tags() {
+                for (auto& f : folded_tags)
+                    f.first->swap(*f.second);
+
+                folded_tags.clear();
+            }
+
+            void append_line(size_t index, const std::string& line) {
+                lane& l = lanes[index];
+
+                if (l.post_data.empty())
+                    l.first_point = std::chrono::steady_clock::now();
+
+                l.post_data.append(line);
+                l.post_points++;
+
+                INFLUXDB_PROBE(serialize, index / priorities, l.rank, line.size(), l.post_data.size());
+
+                if (l.post_data.size() >= lane_target(l)) {
+                    flush_lane(index);
+                    dispatch();
+                }
+            }
+
+            // Reads one gauge into its lane and returns the CPU time it took
+            std::chrono::nanoseconds collect_gauge(gauge& g, std::chrono::system_clock::time_point now) {
+                if (g.prefix.empty() || g.tags_version != default_tags.get_version()) {
+                    fmt::MemoryWriter out;
+                    g.point.write_series(out, default_tags);
+                    out << ' ';
+
+                    if (g.value)
+                        out << g.field << '=';
+
+                    g.prefix = out.str();
+                    g.tags_version = default_tags.get_version();
+                }
+
+                gauge_line.assign(g.prefix);
+
+                auto begin = detail::thread_cpu_time();
+                double value = 0;
+                bool ok = true;
+
+                try {
+                    if (g.value)
+                        value = g.value();
+                    else
+                        g.fields(gauge_line);
+                }
+                catch (...) {
+                    ok = false;
+                }
+
+                auto cost = detail::thread_cpu_time() - begin;
+                g.stats.calls++;
+                g.stats.last_cpu = cost;
+                g.stats.total_cpu += cost;
+
+                if (!ok || (g.value && !std::isfinite(value))) {
+                    g.stats.errors++;
+                    return cost;
+                }
+
+                size_t route = g.point.route;
+
+                if (g.value)
+                    gauge_line.append(detail::format_double(value));
+                else if (gauge_line.size() == g.prefix.size())
+                    return cost;
+
+                gauge_line.append(fmt::format(" {}\n", metric::to_timestamp(now, route_precision[route])));
+                append_line(route * priorities + static_cast<size_t>(g.point.prio), gauge_line);
+                return cost;
+            }
+
+            size_t abort_transfers() {
+                size_t spilled = 0;
+
+                output->cancel();
+
+                for (auto& t : transfers) {
+                    spill(t.second.data.body);
+                    spilled++;
+                }
+
+                transfers.clear();
+
+                for (auto& l : lanes) {
+                    for (auto& b : l.pending) {
+                        spill(b.body);
+                        spilled++;
+                    }
+
+                    l.pending.clear();
+                    l.in_flight = 0;
+
+                    if (!l.post_data.empty()) {
+                        spill(l.post_data);
+                        l.post_data.clear();
+                        l.post_points = 0;
+                        spilled++;
+                    }
+                }
+
+                pending_bytes = 0;
+
+                return spilled;
+            }
+
+            // Appends the lanes of a new route and keeps the dispatch order
+            // by priority first, then route
+            void add_lanes(precision p) {
+                size_t first = lanes.size();
+                lanes.resize(first + priorities);
+
+                for (size_t i = 0; i < priorities; i++) {
+                    lane& l = lanes[first + i];
+                    l.rank = i;
+                    l.post_data.reserve(max_buffer);
+
+                    if (first > 0)
+                        l.policy = lanes[i].policy;
+                }
+
+                route_precision.push_back(p);
+                lane_order.clear();
+
+                for (size_t rank = 0; rank < priorities; rank++) {
+                    for (size_t i = rank; i < lanes.size(); i += priorities)
+                        lane_order.push_back(i);
+                }
+            }
+
+            size_t lane_target(const lane& l) const {
+                return l.policy.batch_size > 0 ? l.policy.batch_size : batch_target;
+            }
+
+            void flush_lane(size_t index) {
+                lane& l = lanes[index];
+
+                if (l.post_data.empty())
+                    return;
+
+                batch b;
+                b.body.swap(l.post_data);
+                b.points = l.post_points;
+                b.lane = index;
+                l.post_data.reserve(lane_target(l));
+                l.post_points = 0;
+
+                if (merge)
+                    b.points = detail::merge_lines(b.body, sort_lines, merge_groups);
+                if (order == batch_order::series_time)
+                    detail::sort_batch(b.body, sort_lines, sort_scratch);
+
+                INFLUXDB_PROBE(flush, index / priorities, l.rank, b.body.size(), b.points);
+                enqueue(std::move(b));
+            }
+
+            void flush_expired_lanes() {
+                auto now = std::chrono::steady_clock::now();
+
+                for (size_t i = 0; i < lanes.size(); i++) {
+                    const lane& l = lanes[i];
+
+                    if (!l.post_data.empty() && l.policy.max_delay.count() > 0
+                        && now - l.first_point >= l.policy.max_delay)
+                        flush_lane(i);
+                }
+            }
+
+            void enqueue(batch&& b) {
+                // shed whole batches so what is lost is deterministic,
+                // starting with the least important lane that has any
+                while (pending_bytes > 0 && pending_bytes + b.body.size() > limits.max_pending_bytes) {
+                    size_t victim = lane_order.size();
+
+                    while (victim > 0 && lanes[lane_order[victim - 1]].pending.empty())
+                        victim--;
+
+                    lane& shed = lanes[lane_order[victim - 1]];
+                    size_t rank = lanes[b.lane].rank;
+
+                    // never evict more important data to make room
+                    if (shed.rank < rank || (shed.rank == rank && limits.policy == backpressure::drop_newest)) {
+                        drop(b);
+                        return;
+                    }
+
+                    std::deque<batch>& queue = shed.pending;
+
+                    if (limits.policy == backpressure::drop_newest) {
+                        drop(queue.back());
+                        pending_bytes -= queue.back().body.size();
+                        queue.pop_back();
+                    }
+                    else {
+                        drop(queue.front());
+                        pending_bytes -= queue.front().body.size();
+                        queue.pop_front();
+                    }
+                }
+
+                pending_bytes += b.body.size();
+                lanes[b.lane].pending.push_back(std::move(b));
+            }
+
+            void dispatch() {
+                dispatch_pending();
+
+                if (unflushed) {
+                    unflushed = false;
+                    output->flush();
+                }
+            }
+
+            void dispatch_pending() {
+                bool limited = byte_bucket.enabled() || point_bucket.enabled();
+                auto now = std::chrono::steady_clock::now();
+
+                for (size_t index : lane_order) {
+                    lane& l = lanes[index];
+
+                    while (!l.pending.empty()) {
+                        if (l.policy.max_in_flight > 0 && l.in_flight >= l.policy.max_in_flight)
+                            break;
+
+                        batch& b = l.pending.front();
+
+                        if (b.not_before > now)
+                            break;
+
+                        double bytes = static_cast<double>(b.body.size());
+                        double points = static_cast<double>(b.points);
+
+                        // less important lanes must not take the
+                        // tokens this batch is waiting for
+                        if (limited
+                            && ((byte_bucket.enabled() && !byte_bucket.can_consume(bytes, now))
+                                || (point_bucket.enabled() && !point_bucket.can_consume(points, now))))
+                            return;
+
+                        if (!breaker.allow(now))
+                            return;
+
+                        if (limited) {
+                            if (byte_bucket.enabled())
+                                byte_bucket.consume(bytes);
+                            if (point_bucket.enabled())
+                                point_bucket.consume(points);
+                        }
+
+                        pending_bytes -= b.body.size();
+                        batch next(std::move(b));
+                        l.pending.pop_front();
+                        send(std::move(next));
+                    }
+                }
+            }
+
+            void send(batch&& b) {
+                uint64_t id = next_id++;
+
+                // the transfer owns its body until completion so it can
+                // still be spilled if the client shuts down underneath it
+                transfer& t = transfers[id];
+                t.data = std::move(b);
+                t.started = std::chrono::steady_clock::now();
+                lanes[t.data.lane].in_flight++;
+                unflushed = true;
+
+                INFLUXDB_PROBE(dispatch, id, t.data.lane / priorities, lanes[t.data.lane].rank, t.data.body.size(),
+                               t.data.points, t.data.attempts, pending_bytes);
+
+                try {
+                    output->send_to(t.data.lane / priorities, id, t.data.body);
+                }
+                catch (...) {
+                    lanes[t.data.lane].in_flight--;
+                    spill(t.data.body);
+                    transfers.erase(id);
+                    throw;
+                }
+            }
+
+            void complete(const completion& c) {
+                auto itr = transfers.find(c.id);
+
+                if (itr == transfers.end())
+                    return;
+
+                batch data(std::move(itr->second.data));
+                lanes[data.lane].in_flight--;
+
+                auto now = std::chrono::steady_clock::now();
+
+                INFLUXDB_PROBE(complete, c.id, data.lane / priorities, c.status, c.error.empty() ? 0 : 1, c.transient ? 1 : 0,
+                               std::chrono::duration_cast<std::chrono::microseconds>(now - itr->second.started).count(),
+                               data.body.size());
+
+                transfers.erase(itr);
+
+                if (save_failures) {
+                    if (!c.error.empty())
+                        failed_transfers.push_back(c.error);
+                    else if (c.status >= 400)
+                        failed_transfers.push_back(fmt::format("HTTP error {}", c.status));
+                }
+
+                if (!c.transient) {
+                    // a rejected batch still means the server is healthy
+                    breaker.record_success();
+                    return;
+                }
+
+                breaker.record_failure(now);
+
+                if (data.attempts < retries.max_retries) {
+                    data.attempts++;
+                    auto delay = retries.backoff * (1 << std::min<size_t>(data.attempts - 1, 16));
+                    data.not_before = now + delay;
+
+                    INFLUXDB_PROBE(retry, c.id, data.lane / priorities, data.attempts,
+                                   std::chrono::duration_cast<std::chrono::microseconds>(delay).count(), data.body.size());
+
+                    pending_bytes += data.body.size();
+                    lanes[data.lane].pending.push_front(std::move(data));
+                }
+                else {
+                    INFLUXDB_PROBE(give_up, c.id, data.lane / priorities, data.attempts, data.body.size());
+                    spill(data.body);
+                }
+            }
+
+            void drop(const batch& b) {
+                INFLUXDB_PROBE(drop, b.lane / priorities, lanes[b.lane].rank, b.body.size(), b.points);
+                dropped_points += b.points;
+                dropped_bytes += b.body.size();
+                spill(b.body);
+            }
+
+            std::chrono::microseconds dispatch_wait() const {
+                auto now = std::chrono::steady_clock::now();
+                std::chrono::microseconds wait = std::max(std::chrono::microseconds(1000), breaker.wait_time(now));
+
+                for (size_t index : lane_order) {
+                    const lane& l = lanes[index];
+
+                    if (l.pending.empty())
+                        continue;
+
+                    const batch& b = l.pending.front();
+
+                    if (byte_bucket.enabled())
+                        wait = std::max(wait, byte_bucket.wait_time(static_cast<double>(b.body.size())));
+                    if (point_bucket.enabled())
+                        wait = std::max(wait, point_bucket.wait_time(static_cast<double>(b.points)));
+                    if (b.not_before > now)
+                        wait = std::max(wait, std::chrono::duration_cast<std::chrono::microseconds>(b.not_before - now));
+
+                    break;
+                }
+
+                return wait;
+            }
+
+            void adapt_batch_target(const completion& c) {
+                using namespace std::chrono;
+
+                auto itr = transfers.find(c.id);
+
+                if (itr == transfers.end())
+                    return;
+
+                auto started = itr->second.started;
+                last_latency = duration_cast<milliseconds>(steady_clock::now() - started);
+
+                bool congested = c.timed_out || c.status == 429 || c.status >= 500
+                                 || last_latency > aimd.latency_slo;
+
+                if (congested) {
+                    // transfers already in flight when we last backed off
+                    // carry no new information, only react once per round
+                    if (started < last_decrease)
+                        return;
+
+                    batch_target = std::max(aimd.min_size,
+                                            static_cast<size_t>(batch_target * aimd.decrease_factor));
+                    last_decrease = steady_clock::now();
+                }
+                else if (c.delivered())
+                    batch_target = std::min(aimd.max_size, batch_target + aimd.increase_step);
+            }
+
+            void spill(const std::string& data) {
+                if (spill_sink)
+                    spill_sink(data);
+            }
+
+            static const size_t priorities = 3;
+
+            std::unique_ptr<transport> output;
+            std::vector<precision> route_precision;
+
+            size_t max_buffer;
+            tag_set default_tags;
+            std::vector<lane> lanes;
+            std::vector<size_t> lane_order;
+            std::unordered_map<uint64_t, transfer> transfers;
+            // sends since the last transport flush()
+            bool unflushed = false;
+            std::vector<completion> completed;
+            std::vector<std::string> failed_transfers;
+            bool save_failures;
+            uint64_t next_id;
+
+            bool adaptive;
+            adaptive_batching aimd;
+            size_t batch_target;
+            std::chrono::milliseconds last_latency;
+            std::chrono::steady_clock::time_point last_decrease;
+
+            batch_order order;
+            bool merge;
+            std::vector<detail::line_ref> sort_lines;
+            std::vector<detail::line_ref> sort_scratch;
+            std::unordered_map<uint64_t, size_t> merge_groups;
+
+            size_t pending_bytes;
+            rate_limit limits;
+            token_bucket byte_bucket;
+            token_bucket point_bucket;
+            uint64_t dropped_points;
+            uint64_t dropped_bytes;
+            retry_policy retries;
+            circuit_breaker breaker;
+
+            std::function<void(const std::string&)> spill_sink;
+            bool drain_on_destroy;
+            std::chrono::milliseconds drain_deadline;
+
+            std::vector<std::unique_ptr<gauge>> gauges;
+            std::chrono::milliseconds gauge_interval;
+            std::chrono::microseconds gauge_budget;
+            std::chrono::steady_clock::time_point last_gauge_collection;
+            size_t next_gauge;
+            std::string gauge_line;
+
+            std::unordered_map<std::string, std::vector<std::unique_ptr<tag_limit>>> tag_limits;
+            std::vector<std::pair<std::string*, std::string*>> folded_tags;
+    };
+
+    // Posts batches to the InfluxDB HTTP API through the libcurl multi interface
+    class curl_transport : public transport {
+        public:
+            curl_transport(std::string url, std::string db, precision p)
+                : base_url(url), v2_api(false), headers(nullptr), request_timeout(0),
+                  protocol(http_version::http_1_1), running_handles(0), prev_running_handles(0) {
+                init_multi();
+                write_urls.push_back(format_write_url(base_url, db, p));
+            }
+
+            // Writes to a bucket through the InfluxDB 2.x API
+            curl_transport(std::string url, const v2_target& target, precision p)
+                : base_url(url), v2_api(true), org(target.org), headers(nullptr), request_timeout(0),
+                  protocol(http_version::http_1_1), running_handles(0), prev_running_handles(0) {
+                write_urls.push_back(format_write_url_v2(base_url, target.org, target.bucket, p));
+
+                // the headers go first so nothing else is held if they throw
+                if (!target.token.empty())
+                    set_token(target.token);
+
+                try {
+                    init_multi();
+                }
+                catch (...) {
+                    curl_slist_free_all(headers);
+                    throw;
+                }
+            }
+
+            ~curl_transport() {
+                cancel();
+                curl_multi_cleanup(mhandle);
+                curl_slist_free_all(headers);
+            }
+
+            curl_transport(const curl_transport&) = delete;
+            curl_transport& operator=(const curl_transport&) = delete;
+
+            void send(uint64_t id, const std::string& body) override {
+                send_to(0, id, body);
+            }
+
+            // On the v2 API the database and retention policy name a bucket
+            // the way the v1 compatibility mapping does, as "db/rp"
+            size_t add_route(const destination& d) override {
+                if (v2_api) {
+                    std::string bucket = d.retention_policy.empty() ? d.db : d.db + "/" + d.retention_policy;
+                    write_urls.push_back(format_write_url_v2(base_url, org, bucket, d.ts_precision));
+                }
+                else
+                    write_urls.push_back(format_write_url(base_url, d.db, d.ts_precision, d.retention_policy));
+
+                return write_urls.size() - 1;
+            }
+
+            void send_to(size_t route, uint64_t id, const std::string& body) override {
+                if (route >= write_urls.size())
+                    throw std::invalid_argument("Unknown route");
+
+                CURL* ehandle = curl_easy_init();
+
+                if (ehandle == nullptr)
+                    throw std::runtime_error("Failed to initialize curl easy handle");
+
+                last_activity = std::chrono::steady_clock::now();
+
+                configure_handle(ehandle);
+                curl_easy_setopt(ehandle, CURLOPT_URL, write_urls[route].c_str());
+                curl_easy_setopt(ehandle, CURLOPT_HTTPHEADER, headers);
+                curl_easy_setopt(ehandle, CURLOPT_POSTFIELDSIZE, body.size());
+                curl_easy_setopt(ehandle, CURLOPT_POSTFIELDS, body.data());
+
+                CURLMcode rcode = curl_multi_add_handle(mhandle, ehandle);
+
+                if (rcode != CURLM_OK) {
+                    curl_easy_cleanup(ehandle);
+                    throw std::runtime_error(curl_multi_strerror(rcode));
+                }
+
+                running_handles++;
+                transfers[ehandle] = { id, headers };
+
+                if (headers != nullptr)
+                    header_users[headers]++;
+            }
+
+            void poll(std::vector<completion>& done) override {
+                CURLMcode rcode;
+                prev_running_handles = running_handles;
+
+                rcode = curl_multi_perform(mhandle, &running_handles);
+
+                if (rcode != CURLM_OK)
+                    throw std::runtime_error(curl_multi_strerror(rcode));
+
+                if (running_handles < prev_running_handles) {
+                    // remove any completed transfers
+                    // and report their outcome
+                    do {
+                        int msgq;
+                        cmsg = curl_multi_info_read(mhandle, &msgq);
+
+                        if (cmsg != nullptr && (cmsg->msg == CURLMSG_DONE)) {
+                            CURL* handle = cmsg->easy_handle;
+                            auto itr = transfers.find(handle);
+
+                            if (itr != transfers.end()) {
+                                done.push_back(make_completion(itr->second.id, handle, cmsg->data.result));
+                                release_headers(itr->second.headers);
+                                transfers.erase(itr);
+                            }
+                            else
+                                warmups.erase(std::remove(warmups.begin(), warmups.end(), handle), warmups.end());
+
+                            curl_multi_remove_handle(mhandle, handle);
+                            curl_easy_cleanup(handle);
+                        }
+                    } while (cmsg != nullptr);
+                }
+            }
+
+            void wait(std::chrono::milliseconds timeout) override {
+                CURLMcode rcode = curl_multi_wait(mhandle, nullptr, 0, static_cast<int>(timeout.count()), nullptr);
+
+                if (rcode != CURLM_OK)
+                    throw std::runtime_error(curl_multi_strerror(rcode));
+            }
+
+            void cancel() override {
+                for (auto& t : transfers) {
+                    curl_multi_remove_handle(mhandle, t.first);
+                    curl_easy_cleanup(t.first);
+                    release_headers(t.second.headers);
+                }
+
+                transfers.clear();
+
+                for (auto handle : warmups) {
+                    curl_multi_remove_handle(mhandle, handle);
+                    curl_easy_cleanup(handle);
+                }
+
+                warmups.clear();
+                running_handles = 0;
+            }
+
+            bool is_busy() const override {
+                return running_handles > 0;
+            }
+
+            void maintain() override {
+                if (pool.warm_connections > 0 && pool.keepalive_interval.count() > 0
+                    && std::chrono::steady_clock::now() - last_activity >= pool.keepalive_interval)
+                    warm_up();
+            }
+
+            // Aborts a write that takes longer than the given time, zero disables
+            void set_request_timeout(std::chrono::milliseconds timeout) {
+                request_timeout = timeout;
+            }
+
+            // Adds a header to every write, such as "Content-Encoding: gzip"
+            // for batches the caller compressed itself
+            void add_header(const std::string& header) {
+                extra_headers.push_back(header);
+                rebuild_headers();
+            }
+
+            // Authenticates writes with HTTP basic auth, as InfluxDB 1.x expects
+            void set_credentials(const std::string& user, const std::string& password) {
+                auth_header = "Authorization: Basic " + detail::base64_encode(user + ":" + password);
+                rebuild_headers();
+            }
+
+            // Authenticates writes with an API token, as InfluxDB 2.x expects
+            void set_token(const std::string& token) {
+                auth_header = "Authorization: Token " + token;
+                rebuild_headers();
+            }
+
+            // Applies the connection limits and opens the warm connections, so
+            // the first batches do not pay for DNS, TCP and TLS setup
+            void set_connection_pool(const connection_pool& config) {
+                pool = config;
+
+                // keep every warm connection in the cache
+                long cached = std::max(pool.max_cached_connections, static_cast<long>(pool.warm_connections));
+
+                if (cached > 0)
+                    curl_multi_setopt(mhandle, CURLMOPT_MAXCONNECTS, cached);
+                if (pool.max_host_connections > 0)
+                    curl_multi_setopt(mhandle, CURLMOPT_MAX_HOST_CONNECTIONS, pool.max_host_connections);
+                if (pool.max_total_connections > 0)
+                    curl_multi_setopt(mhandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, pool.max_total_connections);
+
+                warm_up();
+            }
+
+            // Selects the protocol for new connections. With HTTP/2 batches
+            // wait for a stream on an existing connection rather than
+            // opening another one, up to max_streams per connection.
+            void set_http_version(http_version version, long max_streams = 100) {
+                if (version != http_version::http_1_1
+                    && !(curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2))
+                    throw std::runtime_error("libcurl was built without HTTP/2 support");
+
+                protocol = version;
+
+                if (protocol != http_version::http_1_1) {
+                    curl_multi_setopt(mhandle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#if LIBCURL_VERSION_NUM >= 0x074300
+                    curl_multi_setopt(mhandle, CURLMOPT_MAX_CONCURRENT_STREAMS, max_streams);
+#else
+                    (void) max_streams;
+#endif
+                }
+            }
+
+        private:
+            void init_multi() {
+                mhandle = curl_multi_init();
+
+                if (mhandle == nullptr)
+                    throw std::runtime_error("Failed to initialize curl multi interface");
+
+                ping_url = base_url + "/ping";
+            }
+
+            // The header list is built once and shared by every write, so
+            // the auth header is not formatted again per request
+            void rebuild_headers() {
+                curl_slist* list = nullptr;
+                std::vector<const std::string*> lines;
+
+                if (!auth_header.empty())
+                    lines.push_back(&auth_header);
+
+                for (const auto& h : extra_headers)
+                    lines.push_back(&h);
+
+                for (const std::string* h : lines) {
+                    curl_slist* next = curl_slist_append(list, h->c_str());
+
+                    if (next == nullptr) {
+                        curl_slist_free_all(list);
+                        throw std::runtime_error("Failed to append request header");
+                    }
+
+                    list = next;
+                }
+
+                // transfers in flight still point at the old list, the
+                // last of them to finish frees it
+                if (headers != nullptr && header_users.find(headers) == header_users.end())
+                    curl_slist_free_all(headers);
+
+                headers = list;
+            }
+
+            void release_headers(curl_slist* list) {
+                auto itr = header_users.find(list);
+
+                if (itr == header_users.end() || --itr->second > 0)
+                    return;
+
+                header_users.erase(itr);
+
+                if (list != headers)
+                    curl_slist_free_all(list);
+            }
+
+            completion make_completion(uint64_t id, CURL* handle, CURLcode result) {
+                completion c;
+                c.id = id;
+                curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &c.status);
+
+                if (result != CURLE_OK)
+                    c.error = curl_easy_strerror(result);
+
+                c.transient = result != CURLE_OK || c.status == 429 || c.status >= 500;
+                c.timed_out = result == CURLE_OPERATION_TIMEDOUT;
+                return c;
+            }
+
+            // Options shared by every request to the endpoint
+            void configure_handle(CURL* handle) {
+                curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+
+                switch (protocol) {
+                    case http_version::http_1_1:
+                        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+                        break;
+                    case http_version::http_2:
+                        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+                        curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+                        break;
+                    case http_version::http_2_prior_knowledge:
+                        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+                        curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+                        break;
+                }
+
+                if (request_timeout.count() > 0)
+                    curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, static_cast<long>(request_timeout.count()));
+            }
+
+            void warm_up() {
+                last_activity = std::chrono::steady_clock::now();
+
+                // requests issued together cannot share a connection, so
+                // each one leaves another idle connection in the cache
+                for (size_t i = warmups.size(); i < pool.warm_connections; i++) {
+                    CURL* ehandle = curl_easy_init();
+
+                    if (ehandle == nullptr)
+                        throw std::runtime_error("Failed to initialize curl easy handle");
+
+                    configure_handle(ehandle);
+                    curl_easy_setopt(ehandle, CURLOPT_URL, &ping_url[0]);
+                    curl_easy_setopt(ehandle, CURLOPT_NOBODY, 1L);
+
+                    CURLMcode rcode = curl_multi_add_handle(mhandle, ehandle);
+
+                    if (rcode != CURLM_OK) {
+                        curl_easy_cleanup(ehandle);
+                        throw std::runtime_error(curl_multi_strerror(rcode));
+                    }
+
+                    running_handles++;
+                    warmups.push_back(ehandle);
+                }
+            }
+
+            std::string base_url;
+            bool v2_api;
+            std::string org;
+            std::vector<std::string> write_urls;
+            std::string ping_url;
+            std::vector<std::string> extra_headers;
+            std::string auth_header;
+            curl_slist* headers;
+            // transfers in flight on each header list
+            std::unordered_map<curl_slist*, size_t> header_users;
+
+            CURLM* mhandle;
+            CURLMsg* cmsg;
+            struct in_flight {
+                uint64_t id;
+                curl_slist* headers;
+            };
+
+            std::unordered_map<CURL*, in_flight> transfers;
+            std::chrono::milliseconds request_timeout;
+
+            connection_pool pool;
+            std::vector<CURL*> warmups;
+            std::chrono::steady_clock::time_point last_activity;
+            http_version protocol;
+
+            int running_handles;
+            int prev_running_handles;
+    };
+
+    // Keeps every batch in memory, for tests and in-process consumers
+    class memory_transport : public transport {
+        public:
+            void send(uint64_t id, const std::string& body) override {
+                batches.push_back(body);
+
+                completion c;
+                c.id = id;
+                finished.push_back(c);
+            }
+
+            void poll(std::vector<completion>& done) override {
+                done.insert(done.end(), finished.begin(), finished.end());
+                finished.clear();
+            }
+
+            void wait(std::chrono::milliseconds) override {}
+            void cancel() override { finished.clear(); }
+            bool is_busy() const override { return !finished.empty(); }
+
+            const std::vector<std::string>& get_batches() const { return batches; }
+            void clear() { batches.clear(); }
+
+        private:
+            std::vector<std::string> batches;
+            std::vector<completion> finished;
+    };
+
+    class influxdb_client : public batching_client {
+        public:
+            influxdb_client(std::string url, std::string db, precision p,
+                            size_t buffer_size = 2048, bool save_failures = false)
+                : batching_client(std::unique_ptr<transport>(new curl_transport(url, db, p)),
+                                  p, buffer_size, save_failures),
+                  http(static_cast<curl_transport&>(get_transport())) {}
+
+            // Writes to an InfluxDB 2.x bucket, otherwise the same pipeline
+            influxdb_client(std::string url, const v2_target& target, precision p,
+                            size_t buffer_size = 2048, bool save_failures = false)
+                : batching_client(std::unique_ptr<transport>(new curl_transport(url, target, p)),
+                                  p, buffer_size, save_failures),
+                  http(static_cast<curl_transport&>(get_transport())) {}
+
+            // Aborts a write that takes longer than the given time, zero disables
+            void set_request_timeout(std::chrono::milliseconds timeout) {
+                http.set_request_timeout(timeout);
+            }
+
+            void set_credentials(const std::string& user, const std::string& password) {
+                http.set_credentials(user, password);
+            }
+
+            void set_connection_pool(const connection_pool& config) {
+                http.set_connection_pool(config);
+            }
+
+            void set_http_version(http_version version, long max_streams = 100) {
+                http.set_http_version(version, max_streams);
+            }
+
+        private:
+            curl_transport& http;
     };
 }
 
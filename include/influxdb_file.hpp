@@ -0,0 +1,413 @@
+#ifndef INFLUXDB_FILE_HPP
+#define INFLUXDB_FILE_HPP
+
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef INFLUXDB_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#include "influxdb.hpp"
+
+namespace influxdb {
+    // Settings for file_transport. A segment is rotated once it reaches
+    // max_segment_bytes or max_segment_age, zero disables either limit.
+    // Data is synced every sync_interval or sync_bytes, whichever comes
+    // first, and always when a segment is closed, together with the
+    // directory entry that publishes it. compress gzips closed segments in
+    // the background and publishes only the .lp.gz, it needs
+    // INFLUXDB_WITH_ZLIB and -lz.
+    struct file_options {
+        std::string directory = ".";
+        std::string prefix = "metrics";
+        size_t max_segment_bytes = 64 * 1024 * 1024;
+        std::chrono::seconds max_segment_age = std::chrono::seconds(300);
+        std::chrono::milliseconds sync_interval = std::chrono::milliseconds(1000);
+        size_t sync_bytes = 0;
+        bool compress = false;
+    };
+
+    // Appends batches to rotating segment files for shipping later. The
+    // segment being written ends in .lp.open and is renamed to .lp (or
+    // compressed to .lp.gz) once closed, so a shipper only picks up
+    // finished files. All batches queued since the last poll are written
+    // with a single writev. A batch completes once written, so data in the
+    // page cache since the last sync is lost if the host crashes. A segment
+    // whose sync fails is closed as .lp.failed and never published; the
+    // batches of the write that triggered the sync fail as transient.
+    class file_transport : public transport {
+        public:
+            explicit file_transport(const file_options& options = file_options())
+                : options(options), fd(-1), segment_bytes(0), unsynced_bytes(0),
+                  sequence(0), failed(false), sync_failures(0), stopping(false) {
+#ifndef INFLUXDB_WITH_ZLIB
+                if (options.compress)
+                    throw std::invalid_argument("Segment compression needs INFLUXDB_WITH_ZLIB");
+#else
+                if (options.compress)
+                    compressor = std::thread([this] { compress_segments(); });
+#endif
+            }
+
+            ~file_transport() {
+                close_segment();
+
+                if (compressor.joinable()) {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        stopping = true;
+                    }
+
+                    wakeup.notify_one();
+                    compressor.join();
+                }
+            }
+
+            file_transport(const file_transport&) = delete;
+            file_transport& operator=(const file_transport&) = delete;
+
+            void send(uint64_t id, const std::string& body) override {
+                queued.push_back({ id, &body });
+            }
+
+            void poll(std::vector<completion>& done) override {
+                auto now = std::chrono::steady_clock::now();
+
+                if (fd >= 0 && options.max_segment_age.count() > 0 && now - opened >= options.max_segment_age)
+                    close_segment();
+
+                while (!queued.empty())
+                    write_queued(done);
+
+                if (fd >= 0 && unsynced_bytes > 0 && options.sync_interval.count() > 0
+                    && now - last_sync >= options.sync_interval && !sync())
+                    close_segment();
+            }
+
+            void wait(std::chrono::milliseconds) override {}
+
+            void cancel() override {
+                queued.clear();
+            }
+
+            bool is_busy() const override {
+                return !queued.empty();
+            }
+
+            // Closes the current segment so it can be shipped right away
+            void rotate() {
+                close_segment();
+            }
+
+            const std::string& get_segment_path() const { return segment_path; }
+
+            // Syncs that failed and the error of the most recent one
+            uint64_t get_sync_failures() const { return sync_failures; }
+            const std::string& get_sync_error() const { return sync_error; }
+
+        private:
+            struct queued_write {
+                uint64_t id;
+                const std::string* body;
+            };
+
+            void write_queued(std::vector<completion>& done) {
+                std::string error;
+
+                if (fd >= 0 && segment_bytes > 0 && options.max_segment_bytes > 0
+                    && segment_bytes + queued.front().body->size() > options.max_segment_bytes)
+                    close_segment();
+
+                if (fd < 0 && !open_segment(error)) {
+                    fail_queued(done, error);
+                    return;
+                }
+
+                // gather batches up to the segment limit into one writev
+                std::vector<iovec> iov;
+                size_t total = 0;
+                size_t count = 0;
+
+                while (count < queued.size() && iov.size() < IOV_MAX) {
+                    const std::string& body = *queued[count].body;
+
+                    if (count > 0 && options.max_segment_bytes > 0
+                        && segment_bytes + total + body.size() > options.max_segment_bytes)
+                        break;
+
+                    iov.push_back({ const_cast<char*>(body.data()), body.size() });
+                    total += body.size();
+                    count++;
+                }
+
+                if (!write_all(iov, error)) {
+                    fail_queued(done, error);
+                    close_segment();
+                    return;
+                }
+
+                segment_bytes += total;
+                unsynced_bytes += total;
+
+                if (options.sync_bytes > 0 && unsynced_bytes >= options.sync_bytes && !sync()) {
+                    fail_batches(done, count, sync_error);
+                    close_segment();
+                    return;
+                }
+
+                for (size_t i = 0; i < count; i++) {
+                    completion c;
+                    c.id = queued.front().id;
+                    done.push_back(c);
+                    queued.pop_front();
+                }
+
+                if (options.max_segment_bytes > 0 && segment_bytes >= options.max_segment_bytes)
+                    close_segment();
+            }
+
+            bool write_all(std::vector<iovec>& iov, std::string& error) {
+                size_t first = 0;
+
+                while (first < iov.size()) {
+                    ssize_t n = writev(fd, &iov[first], static_cast<int>(iov.size() - first));
+
+                    if (n < 0) {
+                        if (errno == EINTR)
+                            continue;
+
+                        error = fmt::format("Failed to write {}: {}", segment_path, std::strerror(errno));
+                        return false;
+                    }
+
+                    // continue after a short write
+                    size_t written = static_cast<size_t>(n);
+
+                    while (first < iov.size() && written >= iov[first].iov_len) {
+                        written -= iov[first].iov_len;
+                        first++;
+                    }
+
+                    if (first < iov.size()) {
+                        iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+                        iov[first].iov_len -= written;
+                    }
+                }
+
+                return true;
+            }
+
+            void fail_queued(std::vector<completion>& done, const std::string& error) {
+                fail_batches(done, queued.size(), error);
+            }
+
+            void fail_batches(std::vector<completion>& done, size_t count, const std::string& error) {
+                for (size_t i = 0; i < count; i++) {
+                    completion c;
+                    c.id = queued.front().id;
+                    c.error = error;
+                    c.transient = true;
+                    done.push_back(c);
+                    queued.pop_front();
+                }
+            }
+
+            bool open_segment(std::string& error) {
+                using namespace std::chrono;
+                auto stamp = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+
+                segment_path = fmt::format("{}/{}-{}-{:06}.lp", options.directory, options.prefix, stamp, sequence++);
+                std::string open_path = segment_path + ".open";
+
+                fd = open(open_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+                if (fd < 0) {
+                    error = fmt::format("Failed to open {}: {}", open_path, std::strerror(errno));
+                    return false;
+                }
+
+                segment_bytes = 0;
+                unsynced_bytes = 0;
+                failed = false;
+                opened = steady_clock::now();
+                last_sync = opened;
+                return true;
+            }
+
+            // A failed sync may have lost written pages, and a later retry
+            // can succeed without them, so the whole segment is failed
+            bool sync() {
+                if (fdatasync(fd) != 0) {
+                    sync_error = fmt::format("Failed to sync {}: {}", segment_path, std::strerror(errno));
+                    sync_failures++;
+                    failed = true;
+                }
+
+                unsynced_bytes = 0;
+                last_sync = std::chrono::steady_clock::now();
+                return !failed;
+            }
+
+            void close_segment() {
+                if (fd < 0)
+                    return;
+
+                bool ok = sync();
+                close(fd);
+                fd = -1;
+
+                std::string open_path = segment_path + ".open";
+
+                if (segment_bytes == 0) {
+                    unlink(open_path.c_str());
+                    return;
+                }
+
+                if (!ok) {
+                    publish(open_path, segment_path + ".failed");
+                    return;
+                }
+
+                // compressed segments are published as .lp.gz only, by the
+                // compressor, so a shipper never sees the plain file
+                if (options.compress) {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        to_compress.push_back(segment_path);
+                    }
+
+                    wakeup.notify_one();
+                }
+                else if (!publish(open_path, segment_path)) {
+                    sync_error = fmt::format("Failed to publish {}: {}", segment_path, std::strerror(errno));
+                    sync_failures++;
+                }
+            }
+
+            // Renames a segment into place and syncs the directory, so the
+            // new name survives a crash
+            bool publish(const std::string& from, const std::string& to) const {
+                return std::rename(from.c_str(), to.c_str()) == 0 && sync_directory();
+            }
+
+            bool sync_directory() const {
+                int dir = open(options.directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+                if (dir < 0)
+                    return false;
+
+                bool ok = fsync(dir) == 0;
+                close(dir);
+                return ok;
+            }
+
+#ifdef INFLUXDB_WITH_ZLIB
+            void compress_segments() {
+                std::unique_lock<std::mutex> lock(mutex);
+
+                for (;;) {
+                    wakeup.wait(lock, [this] { return stopping || !to_compress.empty(); });
+
+                    if (to_compress.empty())
+                        return;
+
+                    std::string path = to_compress.front();
+                    to_compress.pop_front();
+
+                    lock.unlock();
+                    compress_file(path);
+                    lock.lock();
+                }
+            }
+
+            // Compresses path.open into path.gz, or publishes it as path if
+            // compression fails. The synced plain file is only removed once
+            // the .gz and its name are durable.
+            void compress_file(const std::string& path) {
+                std::string open_path = path + ".open";
+                std::string gz_path = path + ".gz";
+                std::string tmp_path = gz_path + ".open";
+
+                int in = open(open_path.c_str(), O_RDONLY | O_CLOEXEC);
+
+                if (in < 0)
+                    return;
+
+                // gzclose closes its own descriptor, this one is kept to sync
+                int tmp = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                int gz_fd = tmp < 0 ? -1 : dup(tmp);
+                gzFile out = gz_fd < 0 ? nullptr : gzdopen(gz_fd, "wb6");
+
+                if (out == nullptr) {
+                    if (gz_fd >= 0)
+                        close(gz_fd);
+                    if (tmp >= 0) {
+                        close(tmp);
+                        unlink(tmp_path.c_str());
+                    }
+
+                    close(in);
+                    publish(open_path, path);
+                    return;
+                }
+
+                std::unique_ptr<char[]> buf(new char[256 * 1024]);
+                bool ok = true;
+                ssize_t n;
+
+                while ((n = read(in, buf.get(), 256 * 1024)) > 0) {
+                    if (gzwrite(out, buf.get(), static_cast<unsigned>(n)) != n) {
+                        ok = false;
+                        break;
+                    }
+                }
+
+                close(in);
+                ok = gzclose(out) == Z_OK && ok && n == 0;
+                ok = fsync(tmp) == 0 && ok;
+                close(tmp);
+
+                // publish the plain segment if anything went wrong, and keep
+                // it unpublished if only the directory sync failed
+                if (ok && std::rename(tmp_path.c_str(), gz_path.c_str()) == 0) {
+                    if (sync_directory())
+                        unlink(open_path.c_str());
+                }
+                else {
+                    unlink(tmp_path.c_str());
+                    publish(open_path, path);
+                }
+            }
+#endif
+
+            file_options options;
+            int fd;
+            std::string segment_path;
+            size_t segment_bytes;
+            size_t unsynced_bytes;
+            uint64_t sequence;
+            std::chrono::steady_clock::time_point opened;
+            std::chrono::steady_clock::time_point last_sync;
+            std::deque<queued_write> queued;
+            bool failed;
+            uint64_t sync_failures;
+            std::string sync_error;
+
+            std::thread compressor;
+            std::mutex mutex;
+            std::condition_variable wakeup;
+            std::deque<std::string> to_compress;
+            bool stopping;
+    };
+}
+
+#endif
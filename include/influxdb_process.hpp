@@ -0,0 +1,251 @@
+#ifndef INFLUXDB_PROCESS_HPP
+#define INFLUXDB_PROCESS_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "influxdb.hpp"
+
+namespace influxdb {
+    // Reads resource usage of the current process from /proc and of its
+    // cgroup from the cgroup v2 filesystem. Every file is opened once and
+    // re-read with pread into a fixed buffer, and parsed in place. Sources
+    // that cannot be opened, such as /proc/self/io in some containers, are
+    // left out of the output.
+    //
+    // Fields, integers unless noted:
+    //   cpu_user_us, cpu_system_us, threads, virtual_bytes, rss_bytes,
+    //   minor_faults, major_faults                          /proc/self/stat
+    //   rss_peak_bytes, voluntary_switches, involuntary_switches
+    //                                                       /proc/self/status
+    //   read_bytes, write_bytes, read_chars, write_chars,
+    //   read_syscalls, write_syscalls                       /proc/self/io
+    //   cgroup_cpu_usage_us, cgroup_cpu_throttled_us, cgroup_nr_throttled,
+    //   cgroup_memory_bytes, cgroup_memory_limit_bytes, cgroup_pids
+    //                                                       cgroup v2
+    class process_collector {
+        public:
+            explicit process_collector(const std::string& cgroup_root = "/sys/fs/cgroup")
+                : stat_fd(open_file("/proc/self/stat")),
+                  status_fd(open_file("/proc/self/status")),
+                  io_fd(open_file("/proc/self/io")),
+                  cpu_fd(-1), memory_fd(-1), memory_max_fd(-1), pids_fd(-1) {
+                long ticks = sysconf(_SC_CLK_TCK);
+                long page = sysconf(_SC_PAGESIZE);
+                us_per_tick = ticks > 0 ? 1000000 / static_cast<uint64_t>(ticks) : 10000;
+                page_size = page > 0 ? static_cast<uint64_t>(page) : 4096;
+
+                std::string dir = cgroup_dir(cgroup_root);
+
+                if (!dir.empty()) {
+                    cpu_fd = open_file(dir + "/cpu.stat");
+                    memory_fd = open_file(dir + "/memory.current");
+                    memory_max_fd = open_file(dir + "/memory.max");
+                    pids_fd = open_file(dir + "/pids.current");
+                }
+            }
+
+            ~process_collector() {
+                for (int fd : { stat_fd, status_fd, io_fd, cpu_fd, memory_fd, memory_max_fd, pids_fd }) {
+                    if (fd >= 0)
+                        close(fd);
+                }
+            }
+
+            process_collector(const process_collector&) = delete;
+            process_collector& operator=(const process_collector&) = delete;
+
+            // Appends the field set for one sample
+            void write_fields(std::string& out) {
+                size_t start = out.size();
+                size_t n;
+
+                if ((n = read_file(stat_fd)) > 0)
+                    parse_stat(out, start, n);
+
+                if ((n = read_file(status_fd)) > 0) {
+                    append_field(out, start, "rss_peak_bytes", find_value(n, "VmHWM:") * 1024);
+                    append_field(out, start, "voluntary_switches", find_value(n, "voluntary_ctxt_switches:"));
+                    append_field(out, start, "involuntary_switches", find_value(n, "nonvoluntary_ctxt_switches:"));
+                }
+
+                if ((n = read_file(io_fd)) > 0) {
+                    append_field(out, start, "read_bytes", find_value(n, "read_bytes:"));
+                    append_field(out, start, "write_bytes", find_value(n, "write_bytes:"));
+                    append_field(out, start, "read_chars", find_value(n, "rchar:"));
+                    append_field(out, start, "write_chars", find_value(n, "wchar:"));
+                    append_field(out, start, "read_syscalls", find_value(n, "syscr:"));
+                    append_field(out, start, "write_syscalls", find_value(n, "syscw:"));
+                }
+
+                if ((n = read_file(cpu_fd)) > 0) {
+                    append_field(out, start, "cgroup_cpu_usage_us", find_value(n, "usage_usec"));
+                    append_field(out, start, "cgroup_cpu_throttled_us", find_value(n, "throttled_usec"));
+                    append_field(out, start, "cgroup_nr_throttled", find_value(n, "nr_throttled"));
+                }
+
+                if ((n = read_file(memory_fd)) > 0)
+                    append_field(out, start, "cgroup_memory_bytes", parse_number(buffer, buffer + n));
+
+                // memory.max reads "max" when there is no limit
+                if ((n = read_file(memory_max_fd)) > 0 && buffer[0] >= '0' && buffer[0] <= '9')
+                    append_field(out, start, "cgroup_memory_limit_bytes", parse_number(buffer, buffer + n));
+
+                if ((n = read_file(pids_fd)) > 0)
+                    append_field(out, start, "cgroup_pids", parse_number(buffer, buffer + n));
+            }
+
+            bool has_cgroup() const { return cpu_fd >= 0 || memory_fd >= 0; }
+
+        private:
+            static int open_file(const std::string& path) {
+                return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            }
+
+            // The cgroup v2 entry of /proc/self/cgroup reads "0::/path"
+            static std::string cgroup_dir(const std::string& root) {
+                int fd = open_file("/proc/self/cgroup");
+
+                if (fd < 0)
+                    return std::string();
+
+                char buf[4096];
+                ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+                close(fd);
+
+                if (n <= 0)
+                    return std::string();
+
+                std::string content(buf, static_cast<size_t>(n));
+                size_t pos = content.find("0::");
+
+                if (pos != 0 && (pos == std::string::npos || content[pos - 1] != '\n'))
+                    return std::string();
+
+                size_t end = content.find('\n', pos);
+                std::string path = content.substr(pos + 3, end == std::string::npos ? std::string::npos : end - pos - 3);
+                return path == "/" ? root : root + path;
+            }
+
+            size_t read_file(int fd) {
+                if (fd < 0)
+                    return 0;
+
+                ssize_t n = pread(fd, buffer, sizeof(buffer) - 1, 0);
+
+                if (n <= 0)
+                    return 0;
+
+                buffer[n] = '\0';
+                return static_cast<size_t>(n);
+            }
+
+            static uint64_t parse_number(const char* p, const char* end) {
+                uint64_t value = 0;
+
+                while (p < end && (*p == ' ' || *p == '\t'))
+                    p++;
+
+                while (p < end && *p >= '0' && *p <= '9')
+                    value = value * 10 + static_cast<uint64_t>(*p++ - '0');
+
+                return value;
+            }
+
+            // Value of the line starting with key, in "key value" or
+            // "key:\tvalue" files
+            uint64_t find_value(size_t n, const char* key) const {
+                size_t len = std::strlen(key);
+                const char* p = buffer;
+                const char* end = buffer + n;
+
+                while (p < end) {
+                    const char* eol = static_cast<const char*>(std::memchr(p, '\n', static_cast<size_t>(end - p)));
+
+                    if (eol == nullptr)
+                        eol = end;
+
+                    if (static_cast<size_t>(eol - p) > len && std::memcmp(p, key, len) == 0
+                        && (p[len] == ' ' || p[len] == '\t'))
+                        return parse_number(p + len, eol);
+
+                    p = eol + 1;
+                }
+
+                return 0;
+            }
+
+            // Fields of /proc/self/stat are counted from the one after the
+            // command name, which may itself contain spaces and parentheses
+            void parse_stat(std::string& out, size_t start, size_t n) {
+                const char* p = static_cast<const char*>(memrchr(buffer, ')', n));
+
+                if (p == nullptr)
+                    return;
+
+                const char* end = buffer + n;
+                // indexed by field number, 3 to 24 are read
+                uint64_t values[25] = {};
+                size_t field = 3;
+                p++;
+
+                while (p < end && field < 25) {
+                    while (p < end && *p == ' ')
+                        p++;
+
+                    const char* token = p;
+
+                    while (p < end && *p != ' ')
+                        p++;
+
+                    if (token < end && *token >= '0' && *token <= '9')
+                        values[field] = parse_number(token, p);
+
+                    field++;
+                }
+
+                append_field(out, start, "cpu_user_us", values[14] * us_per_tick);
+                append_field(out, start, "cpu_system_us", values[15] * us_per_tick);
+                append_field(out, start, "threads", values[20]);
+                append_field(out, start, "virtual_bytes", values[23]);
+                append_field(out, start, "rss_bytes", values[24] * page_size);
+                append_field(out, start, "minor_faults", values[10]);
+                append_field(out, start, "major_faults", values[12]);
+            }
+
+            static void append_field(std::string& out, size_t start, const char* key, uint64_t value) {
+                if (out.size() > start)
+                    out.push_back(',');
+
+                out.append(key);
+                out.push_back('=');
+
+                fmt::FormatInt digits(value);
+                out.append(digits.data(), digits.size());
+                out.push_back('i');
+            }
+
+            int stat_fd;
+            int status_fd;
+            int io_fd;
+            int cpu_fd;
+            int memory_fd;
+            int memory_max_fd;
+            int pids_fd;
+            uint64_t us_per_tick;
+            uint64_t page_size;
+            char buffer[8192];
+    };
+
+    // Samples the process and its cgroup at every gauge collection of the
+    // client, under the measurement and tags of point
+    inline size_t add_process_metrics(batching_client& client, const metric& point = metric("process")) {
+        std::shared_ptr<process_collector> collector(new process_collector());
+
+        return client.add_collector(point, [collector](std::string& out) {
+            collector->write_fields(out);
+        });
+    }
+}
+
+#endif
@@ -0,0 +1,1110 @@
+#ifndef INFLUXDB_REGISTRY_HPP
+#define INFLUXDB_REGISTRY_HPP
+
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define INFLUXDB_HAVE_TSC 1
+#endif
+
+#if defined(INFLUXDB_WITH_RSEQ) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define INFLUXDB_HAVE_RSEQ 1
+#endif
+#endif
+
+#include "influxdb.hpp"
+
+namespace influxdb {
+    namespace detail {
+        // Cycle counter used by scoped_timer. The TSC is only used when the
+        // CPU reports it as invariant, otherwise ticks are steady_clock
+        // nanoseconds. Ticks are converted to nanoseconds at collection
+        // time against the steady_clock time elapsed since the first use,
+        // so there is no calibration delay up front.
+        class tick_clock {
+            public:
+                static const tick_clock& get() {
+                    static const tick_clock clock;
+                    return clock;
+                }
+
+                uint64_t now() const {
+#ifdef INFLUXDB_HAVE_TSC
+                    if (use_tsc)
+                        return __rdtsc();
+#endif
+                    return steady_ns();
+                }
+
+                double ns_per_tick() const {
+                    if (!use_tsc)
+                        return 1.0;
+
+                    // wait for a long enough interval for a stable ratio
+                    uint64_t ns = steady_ns() - start_ns;
+
+                    while (ns < 1000000)
+                        ns = steady_ns() - start_ns;
+
+                    uint64_t ticks = now() - start_ticks;
+                    return ticks > 0 ? static_cast<double>(ns) / static_cast<double>(ticks) : 1.0;
+                }
+
+                bool is_tsc() const { return use_tsc; }
+
+            private:
+                tick_clock() : use_tsc(invariant_tsc()) {
+                    start_ns = steady_ns();
+                    start_ticks = now();
+                }
+
+                static uint64_t steady_ns() {
+                    using namespace std::chrono;
+                    return static_cast<uint64_t>(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+                }
+
+                static bool invariant_tsc() {
+#ifdef INFLUXDB_HAVE_TSC
+                    unsigned eax, ebx, ecx, edx;
+
+                    if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) && eax >= 0x80000007
+                        && __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+                        return (edx & (1u << 8)) != 0;
+#endif
+                    return false;
+                }
+
+                bool use_tsc;
+                uint64_t start_ns;
+                uint64_t start_ticks;
+        };
+
+        // Power of two number of shards for per-core state, at most 256
+        inline size_t shard_count(size_t wanted) {
+            if (wanted == 0)
+                wanted = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+            size_t count = 1;
+
+            while (count < wanted && count < 256)
+                count <<= 1;
+
+            return count;
+        }
+
+        inline size_t thread_shard() {
+            static std::atomic<size_t> next(0);
+            static thread_local size_t id = next.fetch_add(1, std::memory_order_relaxed);
+            return id;
+        }
+
+        // The CPU the thread runs on when rseq is available, otherwise a
+        // per-thread id
+        inline size_t current_shard() {
+#ifdef INFLUXDB_HAVE_RSEQ
+            if (__rseq_size > 0) {
+                const struct rseq* rs = reinterpret_cast<const struct rseq*>(
+                    static_cast<const char*>(__builtin_thread_pointer()) + __rseq_offset);
+                int cpu = static_cast<int>(__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED));
+
+                if (cpu >= 0)
+                    return static_cast<size_t>(cpu);
+            }
+#endif
+            return thread_shard();
+        }
+
+        // Count, sum, min and max of the values in one time window
+        struct rollup_window {
+            int64_t window = 0;
+            uint64_t count = 0;
+            double sum = 0;
+            double min = 0;
+            double max = 0;
+
+            void add(double v) {
+                if (count == 0 || v < min)
+                    min = v;
+                if (count == 0 || v > max)
+                    max = v;
+
+                sum += v;
+                count++;
+            }
+
+            void merge(const rollup_window& other) {
+                if (other.count == 0)
+                    return;
+
+                if (count == 0 || other.min < min)
+                    min = other.min;
+                if (count == 0 || other.max > max)
+                    max = other.max;
+
+                sum += other.sum;
+                count += other.count;
+            }
+        };
+    }
+
+    // Counter for increments from many threads. Each thread adds to its own
+    // cache line sized slot, chosen by the CPU it runs on when built with
+    // INFLUXDB_WITH_RSEQ on a glibc that registers rseq, or else by a
+    // per-thread id. Slots are only summed when the value is read, so
+    // threads on different cores do not contend for one cache line.
+    class sharded_counter {
+        public:
+            explicit sharded_counter(size_t shards = 0) {
+                count = detail::shard_count(shards);
+
+                // operator new does not honour the 64 byte alignment in C++14
+                storage.reset(new char[(count + 1) * sizeof(slot)]);
+                uintptr_t base = reinterpret_cast<uintptr_t>(storage.get());
+                slots = reinterpret_cast<slot*>((base + sizeof(slot) - 1) & ~(uintptr_t(sizeof(slot)) - 1));
+
+                for (size_t i = 0; i < count; i++)
+                    new (&slots[i]) slot();
+            }
+
+            sharded_counter(const sharded_counter&) = delete;
+            sharded_counter& operator=(const sharded_counter&) = delete;
+
+            void add(uint64_t n) {
+                slots[detail::current_shard() & (count - 1)].value.fetch_add(n, std::memory_order_relaxed);
+            }
+
+            void increment() {
+                add(1);
+            }
+
+            // Sum of every slot, exact once writers are quiescent
+            uint64_t value() const {
+                uint64_t sum = 0;
+
+                for (size_t i = 0; i < count; i++)
+                    sum += slots[i].value.load(std::memory_order_relaxed);
+
+                return sum;
+            }
+
+            size_t shard_count() const { return count; }
+
+        private:
+            struct alignas(64) slot {
+                std::atomic<uint64_t> value;
+
+                slot() : value(0) {}
+            };
+
+            std::unique_ptr<char[]> storage;
+            slot* slots;
+            size_t count;
+    };
+
+    // Histogram of durations in clock ticks with log-linear buckets: eight
+    // per power of two, so a bucket is at most 12.5% wide. Recording is a
+    // single relaxed atomic increment. Each collection reports the
+    // durations recorded since the previous one.
+    class latency_histogram {
+        public:
+            static const size_t bucket_count = 62 * 8;
+
+            latency_histogram() {
+                for (auto& b : buckets)
+                    b.store(0, std::memory_order_relaxed);
+            }
+
+            void record(uint64_t ticks) {
+                buckets[index(ticks)].fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // Appends count, mean and quantiles in nanoseconds, nothing if
+            // no durations were recorded since the last call
+            void write_fields(std::string& out) {
+                std::array<uint64_t, bucket_count> counts;
+                uint64_t total = 0;
+
+                for (size_t i = 0; i < bucket_count; i++) {
+                    counts[i] = buckets[i].exchange(0, std::memory_order_relaxed);
+                    total += counts[i];
+                }
+
+                if (total == 0)
+                    return;
+
+                double scale = detail::tick_clock::get().ns_per_tick();
+                double sum = 0;
+                size_t last = 0;
+
+                for (size_t i = 0; i < bucket_count; i++) {
+                    if (counts[i] > 0) {
+                        sum += static_cast<double>(counts[i]) * midpoint(i);
+                        last = i;
+                    }
+                }
+
+                out.append(fmt::format("count={}i,mean_ns={:.1f},p50_ns={:.1f},p90_ns={:.1f},p99_ns={:.1f},max_ns={:.1f}",
+                                       total, sum / static_cast<double>(total) * scale,
+                                       quantile(counts, total, 0.5) * scale, quantile(counts, total, 0.9) * scale,
+                                       quantile(counts, total, 0.99) * scale,
+                                       lower_bound(last + 1) * scale));
+            }
+
+        private:
+            static size_t index(uint64_t v) {
+                if (v < 8)
+                    return static_cast<size_t>(v);
+
+                size_t msb = 63 - static_cast<size_t>(__builtin_clzll(v));
+                size_t i = ((msb - 2) << 3) + static_cast<size_t>((v >> (msb - 3)) & 7);
+                return std::min(i, bucket_count - 1);
+            }
+
+            static double lower_bound(size_t i) {
+                if (i < 8)
+                    return static_cast<double>(i);
+
+                int msb = static_cast<int>(i >> 3) + 2;
+                return std::ldexp(static_cast<double>(8 + (i & 7)), msb - 3);
+            }
+
+            static double midpoint(size_t i) {
+                return (lower_bound(i) + lower_bound(i + 1)) / 2;
+            }
+
+            static double quantile(const std::array<uint64_t, bucket_count>& counts, uint64_t total, double q) {
+                uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total - 1));
+                uint64_t seen = 0;
+
+                for (size_t i = 0; i < bucket_count; i++) {
+                    seen += counts[i];
+
+                    if (seen > rank)
+                        return midpoint(i);
+                }
+
+                return 0;
+            }
+
+            std::array<std::atomic<uint64_t>, bucket_count> buckets;
+    };
+
+    // Records the lifetime of the scope into a histogram. Costs two reads
+    // of the cycle counter and one relaxed atomic increment.
+    class scoped_timer {
+        public:
+            explicit scoped_timer(latency_histogram& histogram)
+                : histogram(histogram), start(detail::tick_clock::get().now()) {}
+
+            ~scoped_timer() {
+                histogram.record(detail::tick_clock::get().now() - start);
+            }
+
+            scoped_timer(const scoped_timer&) = delete;
+            scoped_timer& operator=(const scoped_timer&) = delete;
+
+        private:
+            latency_histogram& histogram;
+            uint64_t start;
+    };
+
+    // Merging t-digest (Dunning) for quantiles of values with a wide
+    // range. Values are buffered and merged into centroids whose size is
+    // limited by the arcsine scale function, so memory is bounded by the
+    // compression: at most about compression centroids plus a buffer of
+    // five times as many values. Centroids shrink towards the tails, the
+    // outermost ones hold about 1/compression^2 of the values, which sets
+    // how far out quantiles such as p99.9 stay accurate. Not thread safe,
+    // see digest_summary.
+    class tdigest {
+        public:
+            explicit tdigest(double compression = 100) : compression(compression), total(0), min(0), max(0) {
+                if (!(compression >= 10))
+                    throw std::invalid_argument("t-digest compression must be at least 10");
+
+                buffer_limit = static_cast<size_t>(compression) * 5;
+                buffer.reserve(buffer_limit);
+            }
+
+            void add(double value, double weight = 1) {
+                if (!std::isfinite(value) || !(weight > 0))
+                    return;
+
+                if (total == 0 && buffer.empty())
+                    min = max = value;
+                else {
+                    min = std::min(min, value);
+                    max = std::max(max, value);
+                }
+
+                buffer.push_back({ value, weight });
+
+                if (buffer.size() >= buffer_limit)
+                    compress();
+            }
+
+            // Adds the centroids of other, e.g. one filled by another thread
+            void merge(const tdigest& other) {
+                if (other.count() == 0)
+                    return;
+
+                if (count() == 0) {
+                    min = other.min;
+                    max = other.max;
+                }
+                else {
+                    min = std::min(min, other.min);
+                    max = std::max(max, other.max);
+                }
+
+                for (const auto* part : { &other.centroids, &other.buffer }) {
+                    for (const auto& c : *part) {
+                        buffer.push_back(c);
+
+                        if (buffer.size() >= buffer_limit)
+                            compress();
+                    }
+                }
+            }
+
+            // Value at q in [0, 1], NaN when empty
+            double quantile(double q) {
+                compress();
+
+                if (centroids.empty())
+                    return std::nan("");
+                if (q <= 0)
+                    return min;
+                if (q >= 1)
+                    return max;
+
+                double index = q * total;
+                double first = centroids.front().weight / 2;
+
+                if (index < first)
+                    return min + (centroids.front().mean - min) * index / first;
+
+                // interpolate between the centres of neighbouring centroids
+                double center = first;
+
+                for (size_t i = 0; i + 1 < centroids.size(); i++) {
+                    double next = center + (centroids[i].weight + centroids[i + 1].weight) / 2;
+
+                    if (index < next)
+                        return centroids[i].mean
+                               + (centroids[i + 1].mean - centroids[i].mean) * (index - center) / (next - center);
+
+                    center = next;
+                }
+
+                double last = centroids.back().weight / 2;
+                return centroids.back().mean + (max - centroids.back().mean) * (index - center) / last;
+            }
+
+            double count() const {
+                double n = total;
+
+                for (const auto& c : buffer)
+                    n += c.weight;
+
+                return n;
+            }
+
+            double get_min() const { return min; }
+            double get_max() const { return max; }
+
+            double sum() const {
+                double s = 0;
+
+                for (const auto* part : { &centroids, &buffer }) {
+                    for (const auto& c : *part)
+                        s += c.mean * c.weight;
+                }
+
+                return s;
+            }
+
+            size_t centroid_count() {
+                compress();
+                return centroids.size();
+            }
+
+            void reset() {
+                centroids.clear();
+                buffer.clear();
+                total = 0;
+            }
+
+        private:
+            struct centroid {
+                double mean;
+                double weight;
+            };
+
+            static constexpr double pi = 3.14159265358979323846;
+
+            double k_of(double q) const {
+                return compression / (2 * pi) * std::asin(2 * q - 1);
+            }
+
+            double q_of(double k) const {
+                if (k >= compression / 4)
+                    return 1;
+
+                return (std::sin(k * 2 * pi / compression) + 1) / 2;
+            }
+
+            // Merges the buffer into the centroids in one pass over both in
+            // order of mean
+            void compress() {
+                if (buffer.empty())
+                    return;
+
+                buffer.insert(buffer.end(), centroids.begin(), centroids.end());
+                std::sort(buffer.begin(), buffer.end(), [](const centroid& a, const centroid& b) {
+                    return a.mean < b.mean;
+                });
+
+                double weight = 0;
+
+                for (const auto& c : buffer)
+                    weight += c.weight;
+
+                centroids.clear();
+                centroid current = buffer[0];
+                double before = 0;
+                double limit = q_of(k_of(0) + 1) * weight;
+
+                for (size_t i = 1; i < buffer.size(); i++) {
+                    const centroid& c = buffer[i];
+
+                    if (before + current.weight + c.weight <= limit) {
+                        current.weight += c.weight;
+                        current.mean += (c.mean - current.mean) * c.weight / current.weight;
+                    }
+                    else {
+                        before += current.weight;
+                        centroids.push_back(current);
+                        limit = q_of(k_of(before / weight) + 1) * weight;
+                        current = c;
+                    }
+                }
+
+                centroids.push_back(current);
+                total = weight;
+                buffer.clear();
+            }
+
+            double compression;
+            size_t buffer_limit;
+            std::vector<centroid> centroids;
+            std::vector<centroid> buffer;
+            double total;
+            double min;
+            double max;
+    };
+
+    // A t-digest written by any thread. Each thread adds to the digest of
+    // its shard under that shard's lock, and the shards are merged when the
+    // summary is collected, so memory stays bounded by the shard count and
+    // the compression however many values are recorded. Each collection
+    // reports the values recorded since the previous one.
+    class digest_summary {
+        public:
+            digest_summary(const std::vector<double>& quantiles, double compression = 100)
+                : quantiles(quantiles), merged(compression), taken(compression) {
+                for (double q : quantiles) {
+                    if (!(q >= 0 && q <= 1))
+                        throw std::invalid_argument("Quantiles must be between 0 and 1");
+
+                    names.push_back(fmt::format(",p{:g}=", q * 100));
+                }
+
+                shards.resize(detail::shard_count(0));
+
+                for (auto& s : shards)
+                    s.reset(new shard(compression));
+            }
+
+            digest_summary(const digest_summary&) = delete;
+            digest_summary& operator=(const digest_summary&) = delete;
+
+            void record(double value) {
+                shard& s = *shards[detail::current_shard() & (shards.size() - 1)];
+                std::lock_guard<std::mutex> lock(s.mutex);
+                s.digest.add(value);
+            }
+
+            // Appends count, min, max, mean and one field per quantile, such
+            // as p99=, nothing if no values were recorded since the last call
+            void write_fields(std::string& out) {
+                merged.reset();
+
+                for (auto& s : shards) {
+                    {
+                        std::lock_guard<std::mutex> lock(s->mutex);
+                        std::swap(s->digest, taken);
+                    }
+
+                    merged.merge(taken);
+                    taken.reset();
+                }
+
+                double n = merged.count();
+
+                if (n == 0)
+                    return;
+
+                out.append(fmt::format("count={}i,min={},max={},mean={}", static_cast<uint64_t>(n),
+                                       detail::format_double(merged.get_min()), detail::format_double(merged.get_max()),
+                                       detail::format_double(merged.sum() / n)));
+
+                for (size_t i = 0; i < quantiles.size(); i++) {
+                    out.append(names[i]);
+                    out.append(detail::format_double(merged.quantile(quantiles[i])));
+                }
+            }
+
+        private:
+            struct shard {
+                explicit shard(double compression) : digest(compression) {}
+
+                std::mutex mutex;
+                tdigest digest;
+            };
+
+            std::vector<double> quantiles;
+            std::vector<std::string> names;
+            std::vector<std::unique_ptr<shard>> shards;
+            tdigest merged;
+            tdigest taken;
+    };
+
+    // One resolution of a rollup and the route its windows are written to
+    struct rollup_level {
+        std::chrono::milliseconds resolution;
+        size_t route;
+    };
+
+    // Aggregates values into windows of several resolutions from a single
+    // record() call, e.g. 1s windows for a short retention database and
+    // 10s and 60s windows for longer ones. Only the finest level is updated
+    // by record(); each coarser window is built from the closed windows of
+    // the level below, so more levels cost nothing on the recording path.
+    // Windows are aligned to the epoch and written once closed, at the
+    // window start, with the fields count, sum, min, max and mean.
+    class rollup {
+        public:
+            rollup(const metric& point, const std::vector<rollup_level>& levels)
+                : shards(detail::shard_count(0)) {
+                if (levels.empty())
+                    throw std::invalid_argument("Rollup needs at least one level");
+
+                for (size_t i = 0; i < levels.size(); i++) {
+                    int64_t res = levels[i].resolution.count();
+
+                    if (res <= 0)
+                        throw std::invalid_argument("Rollup resolution must be positive");
+                    if (i > 0 && (res <= resolution[i - 1] || res % resolution[i - 1] != 0))
+                        throw std::invalid_argument("Rollup resolutions must be increasing multiples");
+
+                    resolution.push_back(res);
+                    points.push_back(metric(point).set_route(levels[i].route));
+                }
+
+                open.resize(levels.size());
+
+                for (auto& s : shards)
+                    s.reset(new shard());
+            }
+
+            rollup(const rollup&) = delete;
+            rollup& operator=(const rollup&) = delete;
+
+            // Adds a value to the current window of the finest level
+            void record(double value) {
+                int64_t w = window_of(std::chrono::system_clock::now(), resolution[0]);
+                shard& s = *shards[detail::current_shard() & (shards.size() - 1)];
+                std::lock_guard<std::mutex> lock(s.mutex);
+
+                // a value that arrives after its window was written goes into
+                // the next one rather than producing a second point
+                w = std::max(w, s.floor);
+
+                if (s.current.count > 0) {
+                    if (w > s.current.window) {
+                        s.closed.push_back(s.current);
+                        s.current = detail::rollup_window();
+                    }
+                    else
+                        w = s.current.window;
+                }
+
+                s.current.window = w;
+                s.current.add(value);
+            }
+
+            // Writes the windows closed by now into client, called from the
+            // thread that drives the client
+            void flush(batching_client& client, std::chrono::system_clock::time_point now) {
+                int64_t current = window_of(now, resolution[0]);
+                closed.clear();
+
+                for (auto& s : shards) {
+                    std::lock_guard<std::mutex> lock(s->mutex);
+
+                    // a shard may have closed the current window or a later
+                    // one while another still has it open, those wait for the
+                    // next flush so every window is written once
+                    auto ready = std::partition(s->closed.begin(), s->closed.end(),
+                                                [current](const detail::rollup_window& w) { return w.window >= current; });
+                    closed.insert(closed.end(), ready, s->closed.end());
+                    s->closed.erase(ready, s->closed.end());
+
+                    if (s->current.count > 0 && s->current.window < current) {
+                        closed.push_back(s->current);
+                        s->current = detail::rollup_window();
+                    }
+
+                    s->floor = std::max(s->floor, current);
+                }
+
+                std::sort(closed.begin(), closed.end(), [](const detail::rollup_window& a, const detail::rollup_window& b) {
+                    return a.window < b.window;
+                });
+
+                // windows of the same time from different shards are merged
+                for (size_t i = 0; i < closed.size();) {
+                    detail::rollup_window w = closed[i++];
+
+                    while (i < closed.size() && closed[i].window == w.window)
+                        w.merge(closed[i++]);
+
+                    close(client, 0, w);
+                }
+
+                // coarse windows that ended before the current fine window
+                int64_t current_start = current * resolution[0];
+
+                for (size_t level = 1; level < resolution.size(); level++) {
+                    detail::rollup_window& w = open[level];
+
+                    if (w.count > 0 && (w.window + 1) * resolution[level] <= current_start) {
+                        detail::rollup_window done = w;
+                        w = detail::rollup_window();
+                        close(client, level, done);
+                    }
+                }
+            }
+
+        private:
+            struct shard {
+                std::mutex mutex;
+                detail::rollup_window current;
+                std::vector<detail::rollup_window> closed;
+                int64_t floor = 0;
+            };
+
+            static int64_t window_of(std::chrono::system_clock::time_point t, int64_t res) {
+                using namespace std::chrono;
+                return duration_cast<milliseconds>(t.time_since_epoch()).count() / res;
+            }
+
+            // Writes a closed window and folds it into the enclosing window
+            // of the next level
+            void close(batching_client& client, size_t level, const detail::rollup_window& w) {
+                write(client, level, w);
+
+                if (level + 1 == resolution.size())
+                    return;
+
+                int64_t parent = w.window * resolution[level] / resolution[level + 1];
+                detail::rollup_window& p = open[level + 1];
+
+                if (p.count > 0 && p.window != parent) {
+                    detail::rollup_window done = p;
+                    p = detail::rollup_window();
+                    close(client, level + 1, done);
+                }
+
+                p.window = parent;
+                p.merge(w);
+            }
+
+            void write(batching_client& client, size_t level, const detail::rollup_window& w) {
+                fields.clear();
+                fields.append(fmt::format("count={}i,sum={},min={},max={},mean={}", w.count, detail::format_double(w.sum),
+                                          detail::format_double(w.min), detail::format_double(w.max),
+                                          detail::format_double(w.sum / static_cast<double>(w.count))));
+
+                std::chrono::system_clock::time_point start{std::chrono::milliseconds(w.window * resolution[level])};
+                client.add_fields(points[level], fields, start);
+            }
+
+            std::vector<std::unique_ptr<shard>> shards;
+            std::vector<int64_t> resolution;
+            std::vector<metric> points;
+            // the window being built at each level above the finest
+            std::vector<detail::rollup_window> open;
+            std::vector<detail::rollup_window> closed;
+            std::string fields;
+    };
+
+    // Bounds on the series of a series_family. max_series is a hard limit,
+    // split over up to 16 segments that each hold at least 8 series so
+    // CLOCK has a choice of victim; a family below 16 series has a single
+    // segment, and below 8 it can only evict the next series in turn.
+    struct family_limits {
+        size_t max_series = 10000;
+        std::chrono::milliseconds idle_timeout = std::chrono::minutes(10);
+    };
+
+    struct family_stats {
+        size_t series = 0;
+        uint64_t created = 0;
+        // series idle for longer than the timeout, removed at collection
+        uint64_t expired = 0;
+        // series removed to make room, losing what they had not reported
+        uint64_t evicted = 0;
+    };
+
+    // Instruments created on first use for each value of one tag, e.g. a
+    // counter per container id, so series that come and go do not grow
+    // memory without bound. Series are spread over segments, each behind a
+    // reader-writer lock. A lookup of an existing series only takes the
+    // lock shared and sets reference bits, so concurrent writers do not
+    // serialise on a recency list the way they would with LRU. A full
+    // segment makes room with the CLOCK algorithm, and a series that was
+    // not used for idle_timeout is removed after it is reported. A removed
+    // series that is used again starts from scratch.
+    template<typename T>
+    class series_family {
+        public:
+            series_family(const metric& point, const std::string& tag, std::function<T*()> make,
+                          std::function<void(T&, std::string&)> write, const family_limits& limits)
+                : point(point), tag(tag), make(std::move(make)), write(std::move(write)), limits(limits),
+                  created(0), expired(0), evicted(0) {
+                if (!this->make || !this->write)
+                    throw std::invalid_argument("Series family needs callbacks");
+                if (limits.max_series == 0)
+                    throw std::invalid_argument("Series family needs room for a series");
+
+                used_segments = limits.max_series / min_per_segment;
+                if (used_segments > segment_count)
+                    used_segments = segment_count;
+                if (used_segments == 0)
+                    used_segments = 1;
+
+                // the capacities add up to max_series exactly
+                for (size_t i = 0; i < used_segments; i++)
+                    segments[i].capacity = limits.max_series / used_segments + (i < limits.max_series % used_segments);
+            }
+
+            series_family(const series_family&) = delete;
+            series_family& operator=(const series_family&) = delete;
+
+            // Calls f with the instrument of the series for value, creating
+            // it if needed. f runs under a lock of the segment that may be
+            // shared with other threads, so it must be thread safe.
+            template<typename F>
+            void update(const std::string& value, F f) {
+                segment& s = segments[std::hash<std::string>()(value) % used_segments];
+
+                {
+                    std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+                    auto it = s.index.find(value);
+
+                    if (it != s.index.end()) {
+                        entry& e = *s.slots[it->second];
+                        touch(e);
+                        f(*e.instrument);
+                        return;
+                    }
+                }
+
+                std::lock_guard<std::shared_timed_mutex> lock(s.mutex);
+                auto it = s.index.find(value);
+                if (it != s.index.end()) {
+                    entry& e = *s.slots[it->second];
+                    touch(e);
+                    f(*e.instrument);
+                }
+                else
+                    f(*s.slots[insert(s, value)]->instrument);
+            }
+
+            // Writes every series into client and removes the idle ones,
+            // called from the thread that drives the client
+            void flush(batching_client& client, std::chrono::system_clock::time_point now) {
+                auto steady_now = std::chrono::steady_clock::now();
+
+                for (auto& s : segments) {
+                    std::lock_guard<std::shared_timed_mutex> lock(s.mutex);
+
+                    for (size_t i = 0; i < s.slots.size(); i++) {
+                        entry* e = s.slots[i].get();
+
+                        if (e == nullptr)
+                            continue;
+
+                        fields.clear();
+                        write(*e->instrument, fields);
+
+                        if (!fields.empty())
+                            client.add_fields(e->point, fields, now);
+
+                        if (e->touched.load(std::memory_order_relaxed)) {
+                            e->touched.store(false, std::memory_order_relaxed);
+                            e->last_active = steady_now;
+                        }
+                        else if (steady_now - e->last_active >= limits.idle_timeout) {
+                            remove(s, i);
+                            expired.fetch_add(1, std::memory_order_relaxed);
+                        }
+                    }
+                }
+            }
+
+            family_stats get_stats() {
+                family_stats stats;
+
+                for (auto& s : segments) {
+                    std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+                    stats.series += s.index.size();
+                }
+
+                stats.created = created.load(std::memory_order_relaxed);
+                stats.expired = expired.load(std::memory_order_relaxed);
+                stats.evicted = evicted.load(std::memory_order_relaxed);
+                return stats;
+            }
+
+        private:
+            static const size_t segment_count = 16;
+            static const size_t min_per_segment = 8;
+
+            struct entry {
+                entry(const metric& point, T* instrument)
+                    : point(point), instrument(instrument), referenced(false), touched(true),
+                      last_active(std::chrono::steady_clock::now()) {}
+
+                std::string key;
+                metric point;
+                std::unique_ptr<T> instrument;
+                // set by every use after the first, cleared by the CLOCK
+                // hand, so a series used only once is the first to go
+                std::atomic<bool> referenced;
+                // set by every use, cleared at every collection
+                std::atomic<bool> touched;
+                std::chrono::steady_clock::time_point last_active;
+            };
+
+            struct segment {
+                std::shared_timed_mutex mutex;
+                std::unordered_map<std::string, size_t> index;
+                std::vector<std::unique_ptr<entry>> slots;
+                std::vector<size_t> free_slots;
+                size_t capacity = 0;
+                size_t hand = 0;
+            };
+
+            // Only stores when the bits are clear, so series in use do not
+            // keep invalidating each other's cache lines
+            static void touch(entry& e) {
+                if (!e.referenced.load(std::memory_order_relaxed))
+                    e.referenced.store(true, std::memory_order_relaxed);
+                if (!e.touched.load(std::memory_order_relaxed))
+                    e.touched.store(true, std::memory_order_relaxed);
+            }
+
+            size_t insert(segment& s, const std::string& value) {
+                if (s.index.size() >= s.capacity)
+                    evict(s);
+
+                std::unique_ptr<entry> e(new entry(metric(point).add_tag(tag, value), make()));
+                e->key = value;
+
+                size_t i;
+
+                if (!s.free_slots.empty()) {
+                    i = s.free_slots.back();
+                    s.free_slots.pop_back();
+                    s.slots[i] = std::move(e);
+                }
+                else {
+                    i = s.slots.size();
+                    s.slots.push_back(std::move(e));
+                }
+
+                s.index.emplace(value, i);
+                created.fetch_add(1, std::memory_order_relaxed);
+                return i;
+            }
+
+            // Advances the hand past referenced series, clearing their bit,
+            // and removes the first one that was not used since its last pass
+            void evict(segment& s) {
+                for (;;) {
+                    s.hand = (s.hand + 1) % s.slots.size();
+                    entry* e = s.slots[s.hand].get();
+
+                    if (e == nullptr)
+                        continue;
+
+                    if (e->referenced.load(std::memory_order_relaxed)) {
+                        e->referenced.store(false, std::memory_order_relaxed);
+                        continue;
+                    }
+
+                    remove(s, s.hand);
+                    evicted.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+            }
+
+            void remove(segment& s, size_t i) {
+                s.index.erase(s.slots[i]->key);
+                s.slots[i].reset();
+                s.free_slots.push_back(i);
+            }
+
+            metric point;
+            std::string tag;
+            std::function<T*()> make;
+            std::function<void(T&, std::string&)> write;
+            family_limits limits;
+            size_t used_segments;
+            std::array<segment, segment_count> segments;
+            std::string fields;
+            std::atomic<uint64_t> created;
+            std::atomic<uint64_t> expired;
+            std::atomic<uint64_t> evicted;
+    };
+
+    // Creates instruments that are written by any thread and reported as
+    // one point per series at every gauge collection of the client. The
+    // client shares ownership of each instrument, so references stay valid
+    // for as long as the client. Registration is not thread safe and
+    // belongs on the thread that drives the client.
+    class registry {
+        public:
+            explicit registry(batching_client& client) : client(client) {}
+
+            // A histogram reported under point's measurement and tags with
+            // the fields count, mean_ns, p50_ns, p90_ns, p99_ns and max_ns
+            latency_histogram& add_histogram(const metric& point) {
+                std::shared_ptr<latency_histogram> h(new latency_histogram());
+
+                client.add_collector(point, [h](std::string& out) {
+                    h->write_fields(out);
+                });
+
+                return *h;
+            }
+
+            // A counter reported as field under point's measurement and
+            // tags, with the total since it was created
+            sharded_counter& add_counter(const metric& point, const std::string& field) {
+                std::shared_ptr<sharded_counter> c(new sharded_counter());
+                std::string key = field + "=";
+
+                client.add_collector(point, [c, key](std::string& out) {
+                    out.append(key);
+                    out.append(fmt::format("{}i", c->value()));
+                });
+
+                return *c;
+            }
+
+            // A t-digest reported under point's measurement and tags with the
+            // fields count, min, max, mean and p<q*100> for each quantile
+            digest_summary& add_digest(const metric& point,
+                                       const std::vector<double>& quantiles = { 0.5, 0.9, 0.99 },
+                                       double compression = 100) {
+                std::shared_ptr<digest_summary> d(new digest_summary(quantiles, compression));
+
+                client.add_collector(point, [d](std::string& out) {
+                    d->write_fields(out);
+                });
+
+                return *d;
+            }
+
+            // A family of instruments made by make, one series per value of
+            // tag under point's measurement and tags, each reported with the
+            // fields that write appends
+            template<typename T>
+            series_family<T>& add_family(const metric& point, const std::string& tag, std::function<T*()> make,
+                                         std::function<void(T&, std::string&)> write,
+                                         const family_limits& limits = family_limits()) {
+                std::shared_ptr<series_family<T>> f(
+                    new series_family<T>(point, tag, std::move(make), std::move(write), limits));
+                batching_client& target = client;
+
+                client.add_collector(point, [f, &target](std::string&) {
+                    f->flush(target, std::chrono::system_clock::now());
+                });
+
+                return *f;
+            }
+
+            // A counter per value of tag, reported as field with the total
+            // since the series was created. Each series has a single slot,
+            // contention is already spread over the series.
+            series_family<sharded_counter>& add_counter_family(const metric& point, const std::string& tag,
+                                                               const std::string& field,
+                                                               const family_limits& limits = family_limits()) {
+                std::string key = field + "=";
+
+                return add_family<sharded_counter>(point, tag, [] { return new sharded_counter(1); },
+                                                   [key](sharded_counter& c, std::string& out) {
+                                                       out.append(key);
+                                                       out.append(fmt::format("{}i", c.value()));
+                                                   }, limits);
+            }
+
+            // A latency histogram per value of tag, see add_histogram()
+            series_family<latency_histogram>& add_histogram_family(const metric& point, const std::string& tag,
+                                                                   const family_limits& limits = family_limits()) {
+                return add_family<latency_histogram>(point, tag, [] { return new latency_histogram(); },
+                                                     [](latency_histogram& h, std::string& out) {
+                                                         h.write_fields(out);
+                                                     }, limits);
+            }
+
+            // A rollup of values under point's measurement and tags with
+            // one series of windows per level, each written to the route of
+            // its level. Closed windows are written at gauge collection, so
+            // the gauge interval sets how soon they reach the batches; it
+            // should not be longer than the finest resolution when the
+            // windows are wanted as soon as they close.
+            rollup& add_rollup(const metric& point, const std::vector<rollup_level>& levels) {
+                for (const auto& level : levels) {
+                    if (level.route >= client.get_route_count())
+                        throw std::invalid_argument("Rollup level has an unknown route");
+                }
+
+                std::shared_ptr<rollup> r(new rollup(point, levels));
+                batching_client& target = client;
+
+                // the windows carry their own timestamps and routes, so the
+                // collector writes them directly and leaves its own line empty
+                client.add_collector(point, [r, &target](std::string&) {
+                    r->flush(target, std::chrono::system_clock::now());
+                });
+
+                return *r;
+            }
+
+        private:
+            batching_client& client;
+    };
+}
+
+#endif
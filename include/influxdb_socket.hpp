@@ -0,0 +1,301 @@
+#ifndef INFLUXDB_SOCKET_HPP
+#define INFLUXDB_SOCKET_HPP
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "influxdb.hpp"
+
+namespace influxdb {
+    namespace detail {
+        struct socket_address {
+            int family;
+            int type;
+            int protocol;
+            sockaddr_storage addr;
+            socklen_t length;
+        };
+
+        // Every address host and port resolve to, in the order to try them.
+        // Empty when the name does not resolve.
+        inline std::vector<socket_address> resolve_address(const std::string& host, const std::string& port, int type) {
+            addrinfo hints;
+            std::memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = type;
+
+            addrinfo* result = nullptr;
+            std::vector<socket_address> addresses;
+
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0)
+                return addresses;
+
+            for (addrinfo* ai = result; ai != nullptr; ai = ai->ai_next) {
+                if (ai->ai_addrlen > sizeof(sockaddr_storage))
+                    continue;
+
+                socket_address a;
+                a.family = ai->ai_family;
+                a.type = ai->ai_socktype;
+                a.protocol = ai->ai_protocol;
+                std::memcpy(&a.addr, ai->ai_addr, ai->ai_addrlen);
+                a.length = ai->ai_addrlen;
+                addresses.push_back(a);
+            }
+
+            freeaddrinfo(result);
+            return addresses;
+        }
+
+        inline int connect_socket(const std::string& host, const std::string& port, int type) {
+            for (const auto& a : resolve_address(host, port, type)) {
+                int fd = socket(a.family, a.type | SOCK_CLOEXEC, a.protocol);
+
+                if (fd < 0)
+                    continue;
+
+                if (connect(fd, reinterpret_cast<const sockaddr*>(&a.addr), a.length) == 0)
+                    return fd;
+
+                close(fd);
+            }
+
+            return -1;
+        }
+
+        inline int connect_unix_socket(const std::string& path) {
+            sockaddr_un addr;
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+
+            if (path.size() >= sizeof(addr.sun_path))
+                return -1;
+
+            std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+            int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+            if (fd < 0)
+                return -1;
+
+            if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                close(fd);
+                return -1;
+            }
+
+            return fd;
+        }
+    }
+
+    // Sends batches to an InfluxDB UDP listener. Each batch is split on line
+    // boundaries into datagrams of at most max_datagram bytes, a line that
+    // is longer on its own goes out as a single datagram.
+    class udp_transport : public transport {
+        public:
+            udp_transport(const std::string& host, const std::string& port, size_t max_datagram = 1400)
+                : max_datagram(max_datagram) {
+                fd = detail::connect_socket(host, port, SOCK_DGRAM);
+
+                if (fd < 0)
+                    throw std::runtime_error(fmt::format("Failed to open UDP socket to {}:{}", host, port));
+            }
+
+            ~udp_transport() {
+                close(fd);
+            }
+
+            udp_transport(const udp_transport&) = delete;
+            udp_transport& operator=(const udp_transport&) = delete;
+
+            void send(uint64_t id, const std::string& body) override {
+                completion c;
+                c.id = id;
+
+                size_t start = 0;
+
+                while (start < body.size()) {
+                    size_t end = start;
+
+                    // take as many whole lines as fit into one datagram
+                    for (;;) {
+                        size_t eol = body.find('\n', end);
+                        size_t next = eol == std::string::npos ? body.size() : eol + 1;
+
+                        if (end > start && next - start > max_datagram)
+                            break;
+
+                        end = next;
+
+                        if (end == body.size() || next - start >= max_datagram)
+                            break;
+                    }
+
+                    if (::send(fd, body.data() + start, end - start, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+                        c.error = std::strerror(errno);
+                        c.transient = true;
+                        break;
+                    }
+
+                    start = end;
+                }
+
+                finished.push_back(c);
+            }
+
+            void poll(std::vector<completion>& done) override {
+                done.insert(done.end(), finished.begin(), finished.end());
+                finished.clear();
+            }
+
+            void wait(std::chrono::milliseconds) override {}
+            void cancel() override { finished.clear(); }
+            bool is_busy() const override { return !finished.empty(); }
+
+        private:
+            int fd;
+            size_t max_datagram;
+            std::vector<completion> finished;
+    };
+
+    // Streams line protocol over a TCP or Unix domain socket, for example to
+    // a Telegraf socket_listener. A batch completes once it has been fully
+    // written; a socket error fails every queued batch and the next batch
+    // opens a new connection. A retried batch may repeat lines that made it
+    // out before the error, which line protocol writes tolerate.
+    class stream_transport : public transport {
+        public:
+            // TCP connection to host:port
+            stream_transport(const std::string& host, const std::string& port)
+                : host(host), port(port), fd(-1) {}
+
+            // Unix domain socket at path
+            explicit stream_transport(const std::string& path)
+                : path(path), fd(-1) {}
+
+            ~stream_transport() {
+                disconnect();
+            }
+
+            stream_transport(const stream_transport&) = delete;
+            stream_transport& operator=(const stream_transport&) = delete;
+
+            void send(uint64_t id, const std::string& body) override {
+                queued.push_back({ id, &body, 0 });
+                flush();
+            }
+
+            void poll(std::vector<completion>& done) override {
+                flush();
+                done.insert(done.end(), finished.begin(), finished.end());
+                finished.clear();
+            }
+
+            void wait(std::chrono::milliseconds timeout) override {
+                if (fd < 0 || queued.empty())
+                    return;
+
+                pollfd p;
+                p.fd = fd;
+                p.events = POLLOUT;
+                p.revents = 0;
+                ::poll(&p, 1, static_cast<int>(timeout.count()));
+            }
+
+            void cancel() override {
+                queued.clear();
+                finished.clear();
+                disconnect();
+            }
+
+            bool is_busy() const override {
+                return !queued.empty() || !finished.empty();
+            }
+
+        private:
+            struct pending_write {
+                uint64_t id;
+                const std::string* body;
+                size_t offset;
+            };
+
+            bool connect() {
+                fd = path.empty() ? detail::connect_socket(host, port, SOCK_STREAM)
+                                  : detail::connect_unix_socket(path);
+
+                if (fd < 0)
+                    return false;
+
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                return true;
+            }
+
+            void disconnect() {
+                if (fd >= 0) {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+
+            void flush() {
+                if (queued.empty())
+                    return;
+
+                if (fd < 0 && !connect()) {
+                    fail_all(path.empty() ? fmt::format("Failed to connect to {}:{}", host, port)
+                                          : fmt::format("Failed to connect to {}", path));
+                    return;
+                }
+
+                while (!queued.empty()) {
+                    pending_write& w = queued.front();
+                    ssize_t n = ::send(fd, w.body->data() + w.offset, w.body->size() - w.offset, MSG_NOSIGNAL);
+
+                    if (n < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                            return;
+
+                        fail_all(std::strerror(errno));
+                        disconnect();
+                        return;
+                    }
+
+                    w.offset += static_cast<size_t>(n);
+
+                    if (w.offset < w.body->size())
+                        return;
+
+                    completion c;
+                    c.id = w.id;
+                    finished.push_back(c);
+                    queued.pop_front();
+                }
+            }
+
+            void fail_all(const std::string& error) {
+                for (const auto& w : queued) {
+                    completion c;
+                    c.id = w.id;
+                    c.error = error;
+                    c.transient = true;
+                    finished.push_back(c);
+                }
+
+                queued.clear();
+            }
+
+            std::string host;
+            std::string port;
+            std::string path;
+            int fd;
+            std::deque<pending_write> queued;
+            std::vector<completion> finished;
+    };
+}
+
+#endif
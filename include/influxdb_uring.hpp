@@ -0,0 +1,926 @@
+#ifndef INFLUXDB_URING_HPP
+#define INFLUXDB_URING_HPP
+
+#ifndef __linux__
+#error "influxdb_uring.hpp requires Linux io_uring support"
+#endif
+
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "influxdb_socket.hpp"
+
+namespace influxdb {
+    namespace detail {
+        // Minimal io_uring submission/completion ring on top of the raw
+        // syscalls, so no liburing is needed at build time
+        class uring {
+            public:
+                explicit uring(unsigned entries)
+                    : sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes(nullptr),
+                      sqe_tail(0), registered(false) {
+                    std::memset(&params, 0, sizeof(params));
+                    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+
+                    if (ring_fd < 0)
+                        throw std::runtime_error(fmt::format("io_uring_setup failed: {}", std::strerror(errno)));
+
+                    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+                    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+                    if (params.features & IORING_FEAT_SINGLE_MMAP)
+                        sq_size = cq_size = std::max(sq_size, cq_size);
+
+                    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  ring_fd, IORING_OFF_SQ_RING);
+
+                    if (sq_ptr == MAP_FAILED) {
+                        close(ring_fd);
+                        throw std::runtime_error("Failed to map io_uring submission ring");
+                    }
+
+                    if (params.features & IORING_FEAT_SINGLE_MMAP)
+                        cq_ptr = sq_ptr;
+                    else {
+                        cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      ring_fd, IORING_OFF_CQ_RING);
+
+                        if (cq_ptr == MAP_FAILED) {
+                            munmap(sq_ptr, sq_size);
+                            close(ring_fd);
+                            throw std::runtime_error("Failed to map io_uring completion ring");
+                        }
+                    }
+
+                    void* sqe_ptr = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe),
+                                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                         ring_fd, IORING_OFF_SQES);
+
+                    if (sqe_ptr == MAP_FAILED) {
+                        unmap_rings();
+                        close(ring_fd);
+                        throw std::runtime_error("Failed to map io_uring submission entries");
+                    }
+
+                    sqes = static_cast<io_uring_sqe*>(sqe_ptr);
+
+                    char* sq = static_cast<char*>(sq_ptr);
+                    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+                    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+                    sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+                    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+                    char* cq = static_cast<char*>(cq_ptr);
+                    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+                    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+                    cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+                    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+                    sqe_tail = *sq_tail;
+                }
+
+                ~uring() {
+                    munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+                    unmap_rings();
+                    close(ring_fd);
+                }
+
+                uring(const uring&) = delete;
+                uring& operator=(const uring&) = delete;
+
+                // Pins the buffers so fixed reads and writes skip the per
+                // operation page mapping. Returns false when the kernel
+                // refuses, e.g. because of RLIMIT_MEMLOCK.
+                bool register_buffers(const iovec* iov, unsigned count) {
+                    registered = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+                    return registered;
+                }
+
+                bool has_registered_buffers() const { return registered; }
+
+                // Free entries left in the submission queue
+                unsigned space() const {
+                    return params.sq_entries - (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE));
+                }
+
+                // Returns nullptr when the submission queue is full
+                io_uring_sqe* get_sqe() {
+                    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+                    if (sqe_tail - head >= params.sq_entries)
+                        return nullptr;
+
+                    unsigned index = sqe_tail & sq_mask;
+                    io_uring_sqe* sqe = &sqes[index];
+                    std::memset(sqe, 0, sizeof(*sqe));
+                    sq_array[index] = index;
+                    sqe_tail++;
+
+                    return sqe;
+                }
+
+                // Hands every queued entry to the kernel in one syscall and
+                // optionally waits up to timeout for a completion
+                void submit(std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+                    unsigned to_submit = sqe_tail - *sq_tail;
+                    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+                    unsigned flags = 0;
+                    unsigned wait_nr = 0;
+                    io_uring_getevents_arg arg;
+                    __kernel_timespec ts;
+
+                    if (timeout.count() > 0 && (params.features & IORING_FEAT_EXT_ARG)) {
+                        std::memset(&arg, 0, sizeof(arg));
+                        ts.tv_sec = timeout.count() / 1000;
+                        ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+                        arg.ts = reinterpret_cast<uint64_t>(&ts);
+                        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+                        wait_nr = 1;
+                    }
+
+                    if (wait_nr == 0 && timeout.count() > 0) {
+                        // kernels before 5.11 cannot bound the wait
+                        if (to_submit > 0)
+                            enter(to_submit, 0, 0, nullptr, 0);
+
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                        return;
+                    }
+
+                    if (to_submit == 0 && wait_nr == 0)
+                        return;
+
+                    enter(to_submit, wait_nr, flags, wait_nr ? &arg : nullptr, wait_nr ? sizeof(arg) : 0);
+                }
+
+                template<typename F>
+                size_t reap(F&& handler) {
+                    unsigned head = *cq_head;
+                    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+                    size_t count = 0;
+
+                    while (head != tail) {
+                        const io_uring_cqe& cqe = cqes[head & cq_mask];
+                        uint64_t user_data = cqe.user_data;
+                        int res = cqe.res;
+                        head++;
+                        // release the entry before the handler queues more work
+                        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+                        handler(user_data, res);
+                        count++;
+                    }
+
+                    return count;
+                }
+
+            private:
+                void enter(unsigned to_submit, unsigned wait_nr, unsigned flags, void* arg, size_t arg_size) {
+                    long ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags, arg, arg_size);
+
+                    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                        throw std::runtime_error(fmt::format("io_uring_enter failed: {}", std::strerror(errno)));
+                }
+
+                void unmap_rings() {
+                    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+                        munmap(cq_ptr, cq_size);
+                    if (sq_ptr != MAP_FAILED)
+                        munmap(sq_ptr, sq_size);
+                }
+
+                int ring_fd;
+                io_uring_params params;
+                size_t sq_size;
+                size_t cq_size;
+                void* sq_ptr;
+                void* cq_ptr;
+                io_uring_sqe* sqes;
+                io_uring_cqe* cqes;
+
+                unsigned* sq_head;
+                unsigned* sq_tail;
+                unsigned* sq_array;
+                unsigned sq_mask;
+                unsigned* cq_head;
+                unsigned* cq_tail;
+                unsigned cq_mask;
+
+                unsigned sqe_tail;
+                bool registered;
+        };
+    }
+
+    // Settings for uring_transport. Each connection keeps up to
+    // pipeline_depth requests on the wire before their responses arrive.
+    // Requests up to slot_size bytes are copied into registered buffers.
+    // Connects run on the ring and fail after connect_timeout, 0 waits for
+    // the kernel's own TCP timeout.
+    struct uring_options {
+        size_t connections = 2;
+        size_t pipeline_depth = 8;
+        size_t slot_size = 64 * 1024;
+        size_t recv_size = 16 * 1024;
+        std::chrono::milliseconds connect_timeout = std::chrono::milliseconds(5000);
+    };
+
+    // Sends batches as pipelined HTTP/1.1 POSTs over persistent sockets
+    // driven by io_uring instead of libcurl. Only plain http URLs are
+    // supported.
+    class uring_transport : public transport {
+        public:
+            uring_transport(std::string url, std::string db, precision p,
+                            const uring_options& options = uring_options())
+                : options(options),
+                  ring(static_cast<unsigned>(std::max<size_t>(options.connections * 2, 8))),
+                  in_flight(0) {
+                if (options.connections == 0 || options.pipeline_depth == 0)
+                    throw std::invalid_argument("uring_transport needs at least one connection and pipeline slot");
+
+                parse_url(url);
+                // resolved once here, name lookups block
+                resolve();
+
+                add_prefix(format_write_url(base_path, db, p));
+
+                size_t slots = options.connections * options.pipeline_depth;
+                buffers.reset(new char[options.connections * options.recv_size + slots * options.slot_size]);
+
+                std::vector<iovec> iov;
+
+                for (size_t i = 0; i < options.connections; i++)
+                    iov.push_back({ buffers.get() + i * options.recv_size, options.recv_size });
+
+                char* slot_base = buffers.get() + options.connections * options.recv_size;
+
+                for (size_t i = 0; i < slots; i++) {
+                    iov.push_back({ slot_base + i * options.slot_size, options.slot_size });
+                    free_slots.push_back(i);
+                }
+
+                regions = iov;
+                ring.register_buffers(iov.data(), static_cast<unsigned>(iov.size()));
+
+                conns = std::vector<connection>(options.connections);
+            }
+
+            ~uring_transport() {
+                cancel();
+
+                // never free memory the kernel may still read or write
+                if (stale_ops > 0) {
+                    buffers.release();
+
+                    for (auto& r : retired)
+                        r.req.release();
+                }
+            }
+
+            void send(uint64_t id, const std::string& body) override {
+                send_to(0, id, body);
+            }
+
+            size_t add_route(const destination& d) override {
+                add_prefix(format_write_url(base_path, d.db, d.ts_precision, d.retention_policy));
+                return request_prefixes.size() - 1;
+            }
+
+            void send_to(size_t route, uint64_t id, const std::string& body) override {
+                if (route >= request_prefixes.size())
+                    throw std::invalid_argument("Unknown route");
+
+                // the entries are built now and submitted together by flush()
+                queued.push_back({ id, &body, route });
+                dispatch();
+            }
+
+            void flush() override {
+                ring.submit();
+            }
+
+            void poll(std::vector<completion>& done) override {
+                done.insert(done.end(), early.begin(), early.end());
+                early.clear();
+                finished = &done;
+
+                ring.reap([this](uint64_t user_data, int res) {
+                    handle_completion(user_data, res);
+                });
+
+                dispatch();
+                ring.submit();
+                finished = nullptr;
+            }
+
+            void wait(std::chrono::milliseconds timeout) override {
+                ring.submit(timeout);
+            }
+
+            void cancel() override {
+                for (auto& c : conns) {
+                    for (auto& req : c.requests)
+                        retired.push_back({ std::move(req), std::string(), false });
+
+                    c.requests.clear();
+                    disconnect(c);
+                }
+
+                // shutting the sockets down completes their reads and
+                // writes, which still point into the buffers and requests
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+
+                while (stale_ops > 0 && std::chrono::steady_clock::now() < deadline) {
+                    ring.submit(std::chrono::milliseconds(10));
+                    ring.reap([this](uint64_t user_data, int res) {
+                        handle_completion(user_data, res);
+                    });
+                }
+
+                // with nothing in flight no completion will release them
+                if (stale_ops == 0)
+                    release_retired();
+
+                queued.clear();
+                early.clear();
+                in_flight = 0;
+            }
+
+            bool is_busy() const override {
+                return in_flight > 0 || !queued.empty() || !early.empty() || !retired.empty();
+            }
+
+            bool has_registered_buffers() const { return ring.has_registered_buffers(); }
+
+        private:
+            enum op_type : uint64_t {
+                op_write = 1,
+                op_read = 2,
+                op_connect = 3,
+                op_connect_timeout = 4
+            };
+
+            struct request {
+                uint64_t id = 0;
+                const std::string* body = nullptr;
+                size_t route = 0;
+                std::string header;
+                size_t slot = SIZE_MAX;
+                size_t length = 0;
+                size_t written = 0;
+                iovec iov[2];
+            };
+
+            struct connection {
+                int fd = -1;
+                uint32_t generation = 0;
+                // reads and writes submitted in this generation
+                size_t ops = 0;
+                // requests in send order, the first next_write of them are
+                // fully written and waiting for their response
+                std::deque<std::unique_ptr<request>> requests;
+                size_t next_write = 0;
+                bool writing = false;
+                bool reading = false;
+                // requests wait for the connect before anything is written
+                bool connecting = false;
+                __kernel_timespec connect_timeout;
+                std::string received;
+            };
+
+            struct queued_send {
+                uint64_t id;
+                const std::string* body;
+                size_t route;
+            };
+
+            // A request of a closed connection, kept with its slot until the
+            // operations of that connection have completed
+            struct retired_request {
+                std::unique_ptr<request> req;
+                std::string error;
+                bool failed;
+            };
+
+            void add_prefix(const std::string& path) {
+                request_prefixes.push_back(fmt::format("POST {} HTTP/1.1\r\nHost: {}\r\n"
+                                                       "Content-Type: text/plain; charset=utf-8\r\n"
+                                                       "Content-Length: ", path, host_header));
+            }
+
+            void parse_url(const std::string& url) {
+                const std::string scheme("http://");
+
+                if (url.compare(0, scheme.size(), scheme) != 0)
+                    throw std::invalid_argument("uring_transport only supports http:// URLs");
+
+                std::string rest = url.substr(scheme.size());
+                size_t slash = rest.find('/');
+                std::string authority = rest.substr(0, slash);
+                base_path = slash == std::string::npos ? "" : rest.substr(slash);
+
+                if (!base_path.empty() && base_path.back() == '/')
+                    base_path.pop_back();
+
+                size_t colon = authority.rfind(':');
+
+                if (colon != std::string::npos && authority.find(']', colon) == std::string::npos) {
+                    host = authority.substr(0, colon);
+                    port = authority.substr(colon + 1);
+                }
+                else {
+                    host = authority;
+                    port = "80";
+                }
+
+                if (!host.empty() && host.front() == '[')
+                    host = host.substr(1, host.size() - 2);
+
+                host_header = authority;
+            }
+
+            void resolve() {
+                addresses = detail::resolve_address(host, port, SOCK_STREAM);
+                next_address = 0;
+                last_resolve = std::chrono::steady_clock::now();
+            }
+
+            // Queues a connect on the ring, bounded by a linked timeout, so
+            // neither the lookup nor the handshake blocks the caller
+            bool start_connect(size_t index, connection& c) {
+                // a name that did not resolve is looked up again at most once a second
+                if (addresses.empty() && std::chrono::steady_clock::now() - last_resolve >= std::chrono::seconds(1))
+                    resolve();
+
+                if (addresses.empty() || ring.space() < 2)
+                    return false;
+
+                const detail::socket_address& a = addresses[next_address];
+                c.fd = socket(a.family, a.type | SOCK_CLOEXEC, a.protocol);
+
+                if (c.fd < 0)
+                    return false;
+
+                int one = 1;
+                setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                io_uring_sqe* sqe = ring.get_sqe();
+                sqe->opcode = IORING_OP_CONNECT;
+                sqe->fd = c.fd;
+                sqe->addr = reinterpret_cast<uint64_t>(&a.addr);
+                sqe->off = a.length;
+                sqe->user_data = tag(index, c, op_connect);
+                c.connecting = true;
+                c.ops++;
+
+                if (options.connect_timeout.count() > 0) {
+                    sqe->flags |= IOSQE_IO_LINK;
+                    c.connect_timeout.tv_sec = options.connect_timeout.count() / 1000;
+                    c.connect_timeout.tv_nsec = (options.connect_timeout.count() % 1000) * 1000000;
+
+                    io_uring_sqe* timeout = ring.get_sqe();
+                    timeout->opcode = IORING_OP_LINK_TIMEOUT;
+                    timeout->fd = -1;
+                    timeout->addr = reinterpret_cast<uint64_t>(&c.connect_timeout);
+                    timeout->len = 1;
+                    timeout->user_data = tag(index, c, op_connect_timeout);
+                    c.ops++;
+                }
+
+                return true;
+            }
+
+            void disconnect(connection& c) {
+                if (c.fd >= 0) {
+                    // completes any read or write still queued on the socket
+                    ::shutdown(c.fd, SHUT_RDWR);
+                    close(c.fd);
+                    c.fd = -1;
+                }
+
+                c.generation++;
+                stale_ops += c.ops;
+                c.ops = 0;
+                c.writing = false;
+                c.reading = false;
+                c.connecting = false;
+                c.received.clear();
+                c.next_write = 0;
+            }
+
+            uint64_t tag(size_t index, const connection& c, op_type op) const {
+                return (static_cast<uint64_t>(c.generation) << 32) | (index << 8) | op;
+            }
+
+            void dispatch() {
+                while (!queued.empty()) {
+                    // spread the pipeline over the least loaded connection
+                    size_t best = conns.size();
+
+                    for (size_t i = 0; i < conns.size(); i++) {
+                        if (conns[i].requests.size() >= options.pipeline_depth)
+                            continue;
+                        if (best == conns.size() || conns[i].requests.size() < conns[best].requests.size())
+                            best = i;
+                    }
+
+                    if (best == conns.size())
+                        break;
+
+                    connection& c = conns[best];
+                    queued_send next = queued.front();
+                    queued.pop_front();
+
+                    if (c.fd < 0 && !start_connect(best, c)) {
+                        report(next.id, 0, fmt::format("Failed to connect to {}", host_header), true);
+                        continue;
+                    }
+
+                    std::unique_ptr<request> req(new request());
+                    req->id = next.id;
+                    req->body = next.body;
+                    req->route = next.route;
+                    prepare(*req);
+                    c.requests.push_back(std::move(req));
+                    in_flight++;
+                }
+
+                for (size_t i = 0; i < conns.size(); i++) {
+                    connection& c = conns[i];
+
+                    if (c.fd < 0 || c.connecting)
+                        continue;
+
+                    if (!c.writing && c.next_write < c.requests.size())
+                        submit_write(i, c);
+
+                    if (!c.reading && !c.requests.empty())
+                        submit_read(i, c);
+                }
+            }
+
+            void prepare(request& req) {
+                const std::string& body = *req.body;
+
+                req.header = request_prefixes[req.route];
+                req.header.append(std::to_string(body.size()));
+                req.header.append("\r\n\r\n");
+                req.length = req.header.size() + body.size();
+                req.written = 0;
+
+                if (req.length <= options.slot_size && !free_slots.empty()) {
+                    req.slot = free_slots.back();
+                    free_slots.pop_back();
+
+                    char* dst = static_cast<char*>(regions[conns.size() + req.slot].iov_base);
+                    std::memcpy(dst, req.header.data(), req.header.size());
+                    std::memcpy(dst + req.header.size(), body.data(), body.size());
+                }
+                else {
+                    req.iov[0] = { &req.header[0], req.header.size() };
+                    req.iov[1] = { const_cast<char*>(body.data()), body.size() };
+                }
+            }
+
+            void submit_write(size_t index, connection& c) {
+                io_uring_sqe* sqe = ring.get_sqe();
+
+                if (sqe == nullptr)
+                    return;
+
+                request& req = *c.requests[c.next_write];
+                sqe->fd = c.fd;
+                sqe->user_data = tag(index, c, op_write);
+
+                if (req.slot != SIZE_MAX) {
+                    char* src = static_cast<char*>(regions[conns.size() + req.slot].iov_base) + req.written;
+                    sqe->addr = reinterpret_cast<uint64_t>(src);
+                    sqe->len = static_cast<uint32_t>(req.length - req.written);
+
+                    if (ring.has_registered_buffers()) {
+                        sqe->opcode = IORING_OP_WRITE_FIXED;
+                        sqe->buf_index = static_cast<uint16_t>(conns.size() + req.slot);
+                    }
+                    else
+                        sqe->opcode = IORING_OP_WRITE;
+                }
+                else {
+                    // skip whatever a short write already sent
+                    const std::string& body = *req.body;
+                    size_t skip = req.written;
+                    iovec* first = &req.iov[0];
+
+                    if (skip >= req.header.size()) {
+                        skip -= req.header.size();
+                        first = &req.iov[1];
+                        first->iov_base = const_cast<char*>(body.data()) + skip;
+                        first->iov_len = body.size() - skip;
+                    }
+                    else {
+                        req.iov[0] = { &req.header[skip], req.header.size() - skip };
+                        req.iov[1] = { const_cast<char*>(body.data()), body.size() };
+                    }
+
+                    sqe->opcode = IORING_OP_WRITEV;
+                    sqe->addr = reinterpret_cast<uint64_t>(first);
+                    sqe->len = static_cast<uint32_t>(&req.iov[2] - first);
+                }
+
+                // -1 writes at the current position, which sockets require
+                sqe->off = static_cast<uint64_t>(-1);
+                c.writing = true;
+                c.ops++;
+            }
+
+            void submit_read(size_t index, connection& c) {
+                io_uring_sqe* sqe = ring.get_sqe();
+
+                if (sqe == nullptr)
+                    return;
+
+                sqe->fd = c.fd;
+                sqe->user_data = tag(index, c, op_read);
+                sqe->addr = reinterpret_cast<uint64_t>(regions[index].iov_base);
+                sqe->len = static_cast<uint32_t>(options.recv_size);
+                sqe->off = static_cast<uint64_t>(-1);
+
+                if (ring.has_registered_buffers()) {
+                    sqe->opcode = IORING_OP_READ_FIXED;
+                    sqe->buf_index = static_cast<uint16_t>(index);
+                }
+                else
+                    sqe->opcode = IORING_OP_READ;
+
+                c.reading = true;
+                c.ops++;
+            }
+
+            void handle_completion(uint64_t user_data, int res) {
+                size_t index = (user_data >> 8) & 0xffffff;
+                uint32_t generation = static_cast<uint32_t>(user_data >> 32);
+
+                if (index >= conns.size())
+                    return;
+
+                connection& c = conns[index];
+
+                // left over from a connection that has since been closed
+                if (generation != c.generation) {
+                    if (--stale_ops == 0)
+                        release_retired();
+
+                    return;
+                }
+
+                c.ops--;
+
+                if ((user_data & 0xff) == op_connect_timeout)
+                    return;
+
+                if ((user_data & 0xff) == op_connect) {
+                    c.connecting = false;
+
+                    if (res < 0) {
+                        // the next connect tries the next address
+                        next_address = (next_address + 1) % addresses.size();
+                        fail_connection(c, res == -ECANCELED
+                                           ? fmt::format("Timed out connecting to {}", host_header)
+                                           : fmt::format("Failed to connect to {}: {}", host_header, std::strerror(-res)));
+                    }
+                }
+                else if ((user_data & 0xff) == op_write) {
+                    c.writing = false;
+
+                    if (res < 0) {
+                        fail_connection(c, std::strerror(-res));
+                        return;
+                    }
+
+                    request& req = *c.requests[c.next_write];
+                    req.written += static_cast<size_t>(res);
+
+                    if (req.written >= req.length) {
+                        release_slot(req);
+                        c.next_write++;
+                    }
+                }
+                else {
+                    c.reading = false;
+
+                    if (res <= 0) {
+                        fail_connection(c, res < 0 ? std::strerror(-res) : "Connection closed by server");
+                        return;
+                    }
+
+                    c.received.append(static_cast<const char*>(regions[index].iov_base), static_cast<size_t>(res));
+                    parse_responses(c);
+                }
+            }
+
+            // Consumes every complete response in the receive buffer. HTTP/1.1
+            // answers pipelined requests in order, so each one belongs to the
+            // oldest outstanding request.
+            void parse_responses(connection& c) {
+                size_t pos = 0;
+
+                while (c.next_write > 0) {
+                    size_t header_end = c.received.find("\r\n\r\n", pos);
+
+                    if (header_end == std::string::npos)
+                        break;
+
+                    size_t space = c.received.find(' ', pos);
+
+                    if (space == std::string::npos || space > header_end) {
+                        fail_connection(c, "Malformed HTTP response");
+                        return;
+                    }
+
+                    long status = std::strtol(c.received.c_str() + space + 1, nullptr, 10);
+                    size_t body_start = header_end + 4;
+                    size_t length = 0;
+                    bool chunked = false;
+
+                    for (size_t line = c.received.find("\r\n", pos) + 2; line < header_end;) {
+                        size_t eol = c.received.find("\r\n", line);
+
+                        if (header_is(c.received, line, "content-length:"))
+                            length = std::strtoul(c.received.c_str() + line + 15, nullptr, 10);
+                        else if (header_is(c.received, line, "transfer-encoding:")
+                                 && c.received.find("chunked", line) < eol)
+                            chunked = true;
+
+                        line = eol + 2;
+                    }
+
+                    size_t end;
+
+                    if (chunked) {
+                        end = chunked_end(c.received, body_start);
+
+                        if (end == std::string::npos)
+                            break;
+                    }
+                    else {
+                        if (c.received.size() < body_start + length)
+                            break;
+
+                        end = body_start + length;
+                    }
+
+                    std::unique_ptr<request> req(std::move(c.requests.front()));
+                    c.requests.pop_front();
+                    c.next_write--;
+                    in_flight--;
+
+                    std::string error;
+
+                    if (status < 200 || status >= 300) {
+                        error = fmt::format("HTTP error {}", status);
+
+                        if (end > body_start)
+                            error.append(": ").append(c.received, body_start, end - body_start);
+                    }
+
+                    report(req->id, status, error, status == 429 || status >= 500);
+                    pos = end;
+                }
+
+                c.received.erase(0, pos);
+            }
+
+            static bool header_is(const std::string& buf, size_t line, const char* name) {
+                size_t len = std::strlen(name);
+
+                if (buf.size() < line + len)
+                    return false;
+
+                for (size_t i = 0; i < len; i++) {
+                    if (std::tolower(static_cast<unsigned char>(buf[line + i])) != name[i])
+                        return false;
+                }
+
+                return true;
+            }
+
+            static size_t chunked_end(const std::string& buf, size_t pos) {
+                for (;;) {
+                    size_t eol = buf.find("\r\n", pos);
+
+                    if (eol == std::string::npos)
+                        return std::string::npos;
+
+                    size_t size = std::strtoul(buf.c_str() + pos, nullptr, 16);
+
+                    if (size == 0) {
+                        size_t trailer_end = buf.find("\r\n\r\n", eol);
+                        return trailer_end == std::string::npos ? std::string::npos : trailer_end + 4;
+                    }
+
+                    pos = eol + 2 + size + 2;
+
+                    if (pos > buf.size())
+                        return std::string::npos;
+                }
+            }
+
+            // The requests fail once every operation still queued on the
+            // socket has completed, until then they may be read by the kernel
+            void fail_connection(connection& c, const std::string& error) {
+                for (auto& req : c.requests) {
+                    retired.push_back({ std::move(req), error, true });
+                    in_flight--;
+                }
+
+                c.requests.clear();
+                disconnect(c);
+
+                if (stale_ops == 0)
+                    release_retired();
+            }
+
+            void release_retired() {
+                std::vector<retired_request> done;
+                done.swap(retired);
+
+                for (auto& r : done) {
+                    release_slot(*r.req);
+
+                    if (r.failed)
+                        report(r.req->id, 0, r.error, true);
+                }
+            }
+
+            void report(uint64_t id, long status, const std::string& error, bool transient) {
+                completion c;
+                c.id = id;
+                c.status = status;
+                c.error = error;
+                c.transient = transient;
+
+                // sends that fail straight away complete on the next poll
+                if (finished != nullptr)
+                    finished->push_back(c);
+                else
+                    early.push_back(c);
+            }
+
+            void release_slot(request& req) {
+                if (req.slot != SIZE_MAX) {
+                    free_slots.push_back(req.slot);
+                    req.slot = SIZE_MAX;
+                }
+            }
+
+            std::string host;
+            std::string port;
+            std::string host_header;
+            std::string base_path;
+            std::vector<detail::socket_address> addresses;
+            size_t next_address = 0;
+            std::chrono::steady_clock::time_point last_resolve;
+            std::vector<std::string> request_prefixes;
+
+            uring_options options;
+            // declared before the ring so they outlive it
+            std::unique_ptr<char[]> buffers;
+            std::vector<iovec> regions;
+            std::vector<retired_request> retired;
+            detail::uring ring;
+            std::vector<size_t> free_slots;
+            std::vector<connection> conns;
+            // operations of closed connections that have not completed
+            size_t stale_ops = 0;
+
+            std::deque<queued_send> queued;
+            size_t in_flight;
+            std::vector<completion>* finished = nullptr;
+            std::vector<completion> early;
+    };
+
+    class uring_client : public batching_client {
+        public:
+            uring_client(std::string url, std::string db, precision p,
+                         size_t buffer_size = 2048, bool save_failures = false,
+                         const uring_options& options = uring_options())
+                : batching_client(std::unique_ptr<transport>(new uring_transport(url, db, p, options)),
+                                  p, buffer_size, save_failures),
+                  io(static_cast<uring_transport&>(get_transport())) {}
+
+            bool has_registered_buffers() const { return io.has_registered_buffers(); }
+
+        private:
+            uring_transport& io;
+    };
+}
+
+#endif
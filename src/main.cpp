@@ -7,7 +7,10 @@ int main(int argc, char** argv) {
     influxdb::initialize();
 
     {
-        auto client = influxdb::influxdb_client("http://localhost:8086", "test_db", influxdb::precision::milli, 2048, true);
+        influxdb::influxdb_client client("http://localhost:8086", "test_db", influxdb::precision::milli, 2048, true);
+        client.set_spill_sink([](const std::string& data) {
+            std::cout << "Undelivered:\n" << data;
+        });
 
         std::cout << "Creating metrics" << std::endl;
         client.add_metric(influxdb::metric("user_logins").add_field("count", 1));
@@ -24,9 +27,8 @@ int main(int argc, char** argv) {
         std::cout << "Writing metrics" << std::endl;
         client.write_metrics();
 
-        while (client.is_active()) {
-            client.update();
-        }
+        if (!client.shutdown(std::chrono::seconds(5)))
+            std::cout << "Some metrics were not delivered" << std::endl;
 
         std::cout << "Finished writing" << std::endl;
 
@@ -0,0 +1,911 @@
+// Bulk loader for historical backfill. Reads line protocol or CSV dumps
+// through mmap, converts and gzips batches on a pool of worker threads and
+// keeps a number of compressed batches in flight. Progress is written to a
+// checkpoint file as the offset up to which every batch was delivered, so
+// an interrupted load picks up there when run again.
+//
+//   bulk_load --db history --precision s --checkpoint load.ckpt dump-*.lp
+//   bulk_load --db history --measurement weather --tags station data.csv
+
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <influxdb.hpp>
+
+namespace {
+    struct options {
+        std::string url = "http://localhost:8086";
+        std::string db;
+        influxdb::v2_target v2;
+        influxdb::precision prec = influxdb::precision::nano;
+        std::string format;
+        std::string measurement;
+        std::string measurement_column;
+        std::vector<std::string> tags;
+        std::string time_column = "time";
+        size_t batch_bytes = 4 * 1024 * 1024;
+        size_t concurrency = 4;
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        int retries = 5;
+        std::chrono::milliseconds backoff = std::chrono::milliseconds(500);
+        int level = 1;
+        std::string checkpoint;
+        std::vector<std::string> inputs;
+    };
+
+    void usage() {
+        std::cerr <<
+            "usage: bulk_load [options] FILE...\n"
+            "  --url URL              server address (http://localhost:8086)\n"
+            "  --db NAME              target database\n"
+            "  --org, --bucket, --token\n"
+            "                         write to an InfluxDB 2.x bucket instead of a database\n"
+            "  --precision P          timestamp precision: n, u, ms, s, m or h (n)\n"
+            "  --format lp|csv        input format, guessed from the extension by default\n"
+            "  --measurement NAME     measurement for CSV rows\n"
+            "  --measurement-column C take the CSV measurement from column C\n"
+            "  --tags A,B             CSV columns written as tags\n"
+            "  --time-column C        CSV timestamp column (time)\n"
+            "  --batch-bytes N        input bytes per batch (4194304)\n"
+            "  --concurrency N        batches in flight (4)\n"
+            "  --threads N            parser threads (one per core)\n"
+            "  --retries N            attempts per batch after the first (5)\n"
+            "  --backoff MS           delay before the first retry, doubled after each (500)\n"
+            "  --gzip-level N         compression level, 0 sends plain text (1)\n"
+            "  --checkpoint FILE      record progress in FILE and resume from it\n";
+    }
+
+    std::vector<std::string> split(const std::string& s, char sep) {
+        std::vector<std::string> parts;
+        size_t start = 0;
+
+        for (;;) {
+            size_t pos = s.find(sep, start);
+            parts.push_back(s.substr(start, pos - start));
+
+            if (pos == std::string::npos)
+                return parts;
+
+            start = pos + 1;
+        }
+    }
+
+    influxdb::precision parse_precision(const std::string& s) {
+        if (s == "n" || s == "ns")
+            return influxdb::precision::nano;
+        if (s == "u" || s == "us")
+            return influxdb::precision::micro;
+        if (s == "ms")
+            return influxdb::precision::milli;
+        if (s == "s")
+            return influxdb::precision::second;
+        if (s == "m")
+            return influxdb::precision::minute;
+        if (s == "h")
+            return influxdb::precision::hour;
+
+        throw std::invalid_argument("Unknown precision " + s);
+    }
+
+    options parse_args(int argc, char** argv) {
+        options opts;
+
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+
+            if (arg.size() < 2 || arg.compare(0, 2, "--") != 0) {
+                opts.inputs.push_back(arg);
+                continue;
+            }
+
+            if (i + 1 >= argc)
+                throw std::invalid_argument("Missing value for " + arg);
+
+            std::string value = argv[++i];
+
+            if (arg == "--url")
+                opts.url = value;
+            else if (arg == "--db")
+                opts.db = value;
+            else if (arg == "--org")
+                opts.v2.org = value;
+            else if (arg == "--bucket")
+                opts.v2.bucket = value;
+            else if (arg == "--token")
+                opts.v2.token = value;
+            else if (arg == "--precision")
+                opts.prec = parse_precision(value);
+            else if (arg == "--format")
+                opts.format = value;
+            else if (arg == "--measurement")
+                opts.measurement = value;
+            else if (arg == "--measurement-column")
+                opts.measurement_column = value;
+            else if (arg == "--tags")
+                opts.tags = split(value, ',');
+            else if (arg == "--time-column")
+                opts.time_column = value;
+            else if (arg == "--batch-bytes")
+                opts.batch_bytes = std::stoul(value);
+            else if (arg == "--concurrency")
+                opts.concurrency = std::stoul(value);
+            else if (arg == "--threads")
+                opts.threads = std::stoul(value);
+            else if (arg == "--retries")
+                opts.retries = std::stoi(value);
+            else if (arg == "--backoff")
+                opts.backoff = std::chrono::milliseconds(std::stol(value));
+            else if (arg == "--gzip-level")
+                opts.level = std::stoi(value);
+            else if (arg == "--checkpoint")
+                opts.checkpoint = value;
+            else
+                throw std::invalid_argument("Unknown option " + arg);
+        }
+
+        if ((opts.db.empty() && opts.v2.bucket.empty()) || opts.inputs.empty())
+            throw std::invalid_argument("A database or bucket and at least one input file are required");
+        if (opts.batch_bytes == 0 || opts.concurrency == 0 || opts.threads == 0)
+            throw std::invalid_argument("Batch size, concurrency and threads must be positive");
+        if (opts.level < 0 || opts.level > 9)
+            throw std::invalid_argument("Compression level must be between 0 and 9");
+
+        return opts;
+    }
+
+    // Read-only mapping of an input file
+    class mapped_file {
+        public:
+            explicit mapped_file(const std::string& path) : data(nullptr), size(0) {
+                int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+                if (fd < 0)
+                    throw std::runtime_error(fmt::format("Failed to open {}: {}", path, std::strerror(errno)));
+
+                struct stat st;
+
+                if (fstat(fd, &st) != 0) {
+                    close(fd);
+                    throw std::runtime_error(fmt::format("Failed to stat {}: {}", path, std::strerror(errno)));
+                }
+
+                size = static_cast<size_t>(st.st_size);
+
+                if (size > 0) {
+                    void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+                    if (p == MAP_FAILED) {
+                        close(fd);
+                        throw std::runtime_error(fmt::format("Failed to map {}: {}", path, std::strerror(errno)));
+                    }
+
+                    data = static_cast<const char*>(p);
+                    madvise(p, size, MADV_SEQUENTIAL);
+                }
+
+                close(fd);
+            }
+
+            ~mapped_file() {
+                if (data != nullptr)
+                    munmap(const_cast<char*>(data), size);
+            }
+
+            mapped_file(const mapped_file&) = delete;
+            mapped_file& operator=(const mapped_file&) = delete;
+
+            const char* data;
+            size_t size;
+    };
+
+    // Offset up to which each input was delivered, kept in a text file with
+    // one "offset path" line per input and replaced atomically on save
+    class checkpoint {
+        public:
+            explicit checkpoint(const std::string& path) : path(path) {
+                if (path.empty())
+                    return;
+
+                std::ifstream in(path);
+                size_t offset;
+                std::string input;
+
+                while (in >> offset && in.get() == ' ' && std::getline(in, input))
+                    offsets[input] = offset;
+            }
+
+            size_t get(const std::string& input) const {
+                auto itr = offsets.find(input);
+                return itr == offsets.end() ? 0 : itr->second;
+            }
+
+            void set(const std::string& input, size_t offset) {
+                offsets[input] = offset;
+
+                if (path.empty())
+                    return;
+
+                std::string tmp_path = path + ".tmp";
+                FILE* out = std::fopen(tmp_path.c_str(), "w");
+
+                if (out == nullptr)
+                    throw std::runtime_error(fmt::format("Failed to write {}: {}", tmp_path, std::strerror(errno)));
+
+                for (const auto& o : offsets)
+                    std::fprintf(out, "%zu %s\n", o.second, o.first.c_str());
+
+                bool ok = std::fflush(out) == 0 && fdatasync(fileno(out)) == 0;
+                ok = std::fclose(out) == 0 && ok;
+
+                if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+                    throw std::runtime_error(fmt::format("Failed to write {}: {}", path, std::strerror(errno)));
+            }
+
+        private:
+            std::string path;
+            std::map<std::string, size_t> offsets;
+    };
+
+    void append_escaped(std::string& out, const char* s, size_t n, const char* special) {
+        for (size_t i = 0; i < n; i++) {
+            if (std::strchr(special, s[i]) != nullptr)
+                out.push_back('\\');
+
+            out.push_back(s[i]);
+        }
+    }
+
+    // Splits one CSV record into fields, handling quoted fields with ""
+    // escapes. Quoted fields are unescaped into scratch.
+    void split_csv(const char* begin, const char* end, std::vector<std::pair<const char*, size_t>>& fields,
+                   std::string& scratch) {
+        fields.clear();
+        scratch.clear();
+        scratch.reserve(static_cast<size_t>(end - begin));
+
+        const char* p = begin;
+
+        for (;;) {
+            if (p < end && *p == '"') {
+                size_t start = scratch.size();
+                p++;
+
+                while (p < end) {
+                    if (*p == '"') {
+                        if (p + 1 < end && p[1] == '"') {
+                            scratch.push_back('"');
+                            p += 2;
+                            continue;
+                        }
+
+                        p++;
+                        break;
+                    }
+
+                    scratch.push_back(*p++);
+                }
+
+                fields.emplace_back(scratch.data() + start, scratch.size() - start);
+
+                while (p < end && *p != ',')
+                    p++;
+            }
+            else {
+                const char* start = p;
+
+                while (p < end && *p != ',')
+                    p++;
+
+                fields.emplace_back(start, static_cast<size_t>(p - start));
+            }
+
+            if (p >= end)
+                return;
+
+            p++;
+        }
+    }
+
+    // Matches decimal numbers such as -1, 2.5 or 1e-3
+    bool is_number(const char* s, size_t n) {
+        size_t i = n > 0 && (s[0] == '-' || s[0] == '+') ? 1 : 0;
+        size_t digits = 0;
+
+        while (i < n && std::isdigit(static_cast<unsigned char>(s[i]))) {
+            i++;
+            digits++;
+        }
+
+        if (i < n && s[i] == '.') {
+            i++;
+
+            while (i < n && std::isdigit(static_cast<unsigned char>(s[i]))) {
+                i++;
+                digits++;
+            }
+        }
+
+        if (digits == 0)
+            return false;
+
+        if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+            i++;
+
+            if (i < n && (s[i] == '-' || s[i] == '+'))
+                i++;
+
+            if (i == n)
+                return false;
+
+            while (i < n && std::isdigit(static_cast<unsigned char>(s[i])))
+                i++;
+        }
+
+        return i == n;
+    }
+
+    bool is_integer(const char* s, size_t n) {
+        size_t i = n > 0 && s[0] == '-' ? 1 : 0;
+
+        if (i == n)
+            return false;
+
+        for (; i < n; i++) {
+            if (!std::isdigit(static_cast<unsigned char>(s[i])))
+                return false;
+        }
+
+        return true;
+    }
+
+    // Maps CSV columns onto line protocol. Tag columns become tags, the
+    // time column the timestamp and every other column a field; numbers
+    // are written as floats, true and false as booleans and anything else
+    // as a string. Empty cells are left out.
+    class csv_schema {
+        public:
+            csv_schema(const options& opts, const char* begin, const char* end)
+                : measurement_index(-1), time_index(-1) {
+                std::vector<std::pair<const char*, size_t>> header;
+                std::string scratch;
+
+                if (end > begin && end[-1] == '\r')
+                    end--;
+
+                split_csv(begin, end, header, scratch);
+
+                if (opts.measurement.empty() == opts.measurement_column.empty())
+                    throw std::invalid_argument("CSV input needs either --measurement or --measurement-column");
+
+                append_escaped(measurement, opts.measurement.data(), opts.measurement.size(), ", ");
+
+                for (size_t i = 0; i < header.size(); i++) {
+                    std::string name(header[i].first, header[i].second);
+                    column c;
+                    c.is_tag = std::find(opts.tags.begin(), opts.tags.end(), name) != opts.tags.end();
+
+                    if (name == opts.measurement_column)
+                        measurement_index = static_cast<int>(i);
+                    else if (name == opts.time_column)
+                        time_index = static_cast<int>(i);
+                    else
+                        append_escaped(c.key, name.data(), name.size(), ",= ");
+
+                    columns.push_back(c);
+                }
+
+                if (!opts.measurement_column.empty() && measurement_index < 0)
+                    throw std::invalid_argument("CSV header has no column " + opts.measurement_column);
+                if (time_index < 0)
+                    throw std::invalid_argument("CSV header has no column " + opts.time_column);
+            }
+
+            // Appends the line for one record, returns false if it is skipped
+            bool convert(const char* begin, const char* end, std::string& out,
+                         std::vector<std::pair<const char*, size_t>>& cells, std::string& scratch) const {
+                split_csv(begin, end, cells, scratch);
+
+                if (cells.size() != columns.size())
+                    return false;
+
+                const auto& time = cells[time_index];
+
+                if (!is_integer(time.first, time.second))
+                    return false;
+
+                size_t line_start = out.size();
+
+                if (measurement_index >= 0) {
+                    const auto& m = cells[measurement_index];
+
+                    if (m.second == 0)
+                        return false;
+
+                    append_escaped(out, m.first, m.second, ", ");
+                }
+                else
+                    out.append(measurement);
+
+                for (size_t i = 0; i < cells.size(); i++) {
+                    if (!columns[i].is_tag || columns[i].key.empty() || cells[i].second == 0)
+                        continue;
+
+                    out.push_back(',');
+                    out.append(columns[i].key);
+                    out.push_back('=');
+                    append_escaped(out, cells[i].first, cells[i].second, ",= ");
+                }
+
+                char sep = ' ';
+
+                for (size_t i = 0; i < cells.size(); i++) {
+                    const char* value = cells[i].first;
+                    size_t n = cells[i].second;
+
+                    if (columns[i].is_tag || columns[i].key.empty() || n == 0)
+                        continue;
+
+                    out.push_back(sep);
+                    sep = ',';
+                    out.append(columns[i].key);
+                    out.push_back('=');
+
+                    if (is_number(value, n) || (n == 4 && std::memcmp(value, "true", 4) == 0)
+                        || (n == 5 && std::memcmp(value, "false", 5) == 0))
+                        out.append(value, n);
+                    else {
+                        out.push_back('"');
+                        append_escaped(out, value, n, "\"\\");
+                        out.push_back('"');
+                    }
+                }
+
+                // a point needs at least one field
+                if (sep == ' ') {
+                    out.resize(line_start);
+                    return false;
+                }
+
+                out.push_back(' ');
+                out.append(time.first, time.second);
+                out.push_back('\n');
+                return true;
+            }
+
+        private:
+            struct column {
+                std::string key;
+                bool is_tag = false;
+            };
+
+            std::string measurement;
+            std::vector<column> columns;
+            int measurement_index;
+            int time_index;
+    };
+
+    std::string gzip(const std::string& data, int level) {
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+
+        // window bits above 15 select the gzip wrapper
+        if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("Failed to initialize zlib");
+
+        std::string out;
+        out.resize(deflateBound(&zs, data.size()));
+
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        zs.avail_in = static_cast<uInt>(data.size());
+        zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+        zs.avail_out = static_cast<uInt>(out.size());
+
+        int rc = deflate(&zs, Z_FINISH);
+        out.resize(zs.total_out);
+        deflateEnd(&zs);
+
+        if (rc != Z_STREAM_END)
+            throw std::runtime_error("Failed to compress batch");
+
+        return out;
+    }
+
+    // Loads one input file. Workers claim chunks of whole lines in order
+    // and convert them into request bodies; the main thread sends ready
+    // chunks while fewer than concurrency are in flight. Workers stay within
+    // a window past the first undelivered chunk, which bounds memory and
+    // lets the checkpoint advance over a contiguous prefix.
+    class loader {
+        public:
+            loader(const options& opts, influxdb::curl_transport& http, checkpoint& progress)
+                : opts(opts), http(http), progress(progress), points(0), skipped(0) {}
+
+            // Returns false if some batches were rejected by the server
+            bool load(const std::string& path) {
+                mapped_file file(path);
+                size_t start = progress.get(path);
+
+                if (start >= file.size && file.size > 0) {
+                    std::cerr << path << ": already loaded" << std::endl;
+                    return true;
+                }
+
+                std::string format = opts.format;
+
+                if (format.empty())
+                    format = path.size() > 4 && path.compare(path.size() - 4, 4, ".csv") == 0 ? "csv" : "lp";
+
+                std::unique_ptr<csv_schema> schema;
+
+                if (format == "csv") {
+                    const char* eol = static_cast<const char*>(std::memchr(file.data, '\n', file.size));
+                    size_t header_end = eol == nullptr ? file.size : static_cast<size_t>(eol - file.data) + 1;
+                    schema.reset(new csv_schema(opts, file.data, file.data + header_end - (eol != nullptr)));
+                    start = std::max(start, header_end);
+                }
+                else if (format != "lp")
+                    throw std::invalid_argument("Unknown format " + format);
+
+                make_chunks(file, start);
+
+                if (start > 0)
+                    std::cerr << path << ": resuming at byte " << start << std::endl;
+
+                next_chunk = 0;
+                delivered = 0;
+                stopping = false;
+
+                std::vector<std::thread> workers;
+
+                for (size_t i = 0; i < opts.threads; i++)
+                    workers.emplace_back([&] { convert_chunks(file, schema.get()); });
+
+                bool ok = true;
+
+                try {
+                    ok = send_chunks(path, file.size);
+                }
+                catch (...) {
+                    stop_workers(workers);
+                    http.cancel();
+                    throw;
+                }
+
+                stop_workers(workers);
+                return ok;
+            }
+
+            uint64_t get_points() const { return points; }
+            uint64_t get_skipped() const { return skipped; }
+
+        private:
+            struct chunk {
+                size_t begin;
+                size_t end;
+                std::string body;
+                size_t points = 0;
+                size_t skipped = 0;
+                int attempts = 0;
+                bool ready = false;
+                bool done = false;
+                std::chrono::steady_clock::time_point not_before;
+            };
+
+            void make_chunks(const mapped_file& file, size_t start) {
+                chunks.clear();
+
+                while (start < file.size) {
+                    chunk c;
+                    c.begin = start;
+                    c.end = std::min(file.size, start + opts.batch_bytes);
+
+                    if (c.end < file.size) {
+                        const char* eol = static_cast<const char*>(
+                            std::memchr(file.data + c.end, '\n', file.size - c.end));
+                        c.end = eol == nullptr ? file.size : static_cast<size_t>(eol - file.data) + 1;
+                    }
+
+                    chunks.push_back(std::move(c));
+                    start = chunks.back().end;
+                }
+            }
+
+            size_t window() const {
+                return opts.concurrency + opts.threads;
+            }
+
+            void convert_chunks(const mapped_file& file, const csv_schema* schema) {
+                std::vector<std::pair<const char*, size_t>> cells;
+                std::string scratch;
+
+                for (;;) {
+                    size_t index;
+
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        worker_wakeup.wait(lock, [&] {
+                            return stopping || next_chunk >= chunks.size() || next_chunk < delivered + window();
+                        });
+
+                        if (stopping || next_chunk >= chunks.size())
+                            return;
+
+                        index = next_chunk++;
+                    }
+
+                    // chunks never move once workers are running
+                    chunk& c = chunks[index];
+                    std::string body;
+                    size_t chunk_points = 0;
+                    size_t chunk_skipped = 0;
+                    body.reserve(c.end - c.begin + (c.end - c.begin) / 4);
+
+                    const char* p = file.data + c.begin;
+                    const char* end = file.data + c.end;
+
+                    while (p < end) {
+                        const char* eol = static_cast<const char*>(std::memchr(p, '\n', static_cast<size_t>(end - p)));
+                        const char* line_end = eol == nullptr ? end : eol;
+                        const char* next = eol == nullptr ? end : eol + 1;
+
+                        if (line_end > p && line_end[-1] == '\r')
+                            line_end--;
+
+                        if (line_end == p || *p == '#') {
+                            p = next;
+                            continue;
+                        }
+
+                        if (schema == nullptr) {
+                            body.append(p, line_end);
+                            body.push_back('\n');
+                            chunk_points++;
+                        }
+                        else if (schema->convert(p, line_end, body, cells, scratch))
+                            chunk_points++;
+                        else
+                            chunk_skipped++;
+
+                        p = next;
+                    }
+
+                    if (opts.level > 0 && !body.empty())
+                        body = gzip(body, opts.level);
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    c.body = std::move(body);
+                    c.points = chunk_points;
+                    c.skipped = chunk_skipped;
+                    c.ready = true;
+                    sender_wakeup.notify_one();
+                }
+            }
+
+            void stop_workers(std::vector<std::thread>& workers) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                }
+
+                worker_wakeup.notify_all();
+
+                for (auto& w : workers)
+                    w.join();
+            }
+
+            bool send_chunks(const std::string& path, size_t file_size) {
+                std::vector<influxdb::completion> done;
+                size_t next_send = 0;
+                size_t in_flight = 0;
+                bool ok = true;
+                auto last_report = std::chrono::steady_clock::now();
+
+                while (delivered < chunks.size()) {
+                    auto now = std::chrono::steady_clock::now();
+
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+
+                        // retries go out first, they hold back the checkpoint
+                        auto next_retry = now + std::chrono::milliseconds(100);
+
+                        retries.erase(std::remove_if(retries.begin(), retries.end(), [&](size_t index) {
+                            if (in_flight >= opts.concurrency || chunks[index].not_before > now) {
+                                next_retry = std::min(next_retry, chunks[index].not_before);
+                                return false;
+                            }
+
+                            send(index);
+                            in_flight++;
+                            return true;
+                        }), retries.end());
+
+                        while (in_flight < opts.concurrency && next_send < chunks.size() && chunks[next_send].ready) {
+                            chunk& c = chunks[next_send++];
+
+                            if (c.body.empty()) {
+                                finish(c);
+                                continue;
+                            }
+
+                            send(static_cast<size_t>(&c - &chunks[0]));
+                            in_flight++;
+                        }
+
+                        if (in_flight == 0) {
+                            if (advance(path, file_size))
+                                continue;
+
+                            sender_wakeup.wait_until(lock, next_retry);
+                            continue;
+                        }
+                    }
+
+                    http.wait(std::chrono::milliseconds(10));
+                    done.clear();
+                    http.poll(done);
+
+                    std::lock_guard<std::mutex> lock(mutex);
+
+                    for (const auto& result : done) {
+                        chunk& c = chunks[result.id];
+                        in_flight--;
+
+                        if (result.delivered()) {
+                            finish(c);
+                            continue;
+                        }
+
+                        std::string error = result.error.empty() ? fmt::format("HTTP {}", result.status) : result.error;
+
+                        if (result.transient && c.attempts <= opts.retries) {
+                            auto delay = opts.backoff * (1 << std::min(c.attempts - 1, 10));
+                            std::cerr << path << ": bytes " << c.begin << "-" << c.end << " failed (" << error
+                                      << "), retrying in " << delay.count() << " ms" << std::endl;
+                            c.not_before = std::chrono::steady_clock::now() + delay;
+                            retries.push_back(static_cast<size_t>(&c - &chunks[0]));
+                            continue;
+                        }
+
+                        if (result.transient) {
+                            // leave the checkpoint before this batch and stop
+                            advance(path, file_size);
+                            throw std::runtime_error(fmt::format("{}: bytes {}-{} failed after {} attempts: {}",
+                                                                 path, c.begin, c.end, c.attempts, error));
+                        }
+
+                        // the server rejected the data, retrying cannot help
+                        std::cerr << path << ": bytes " << c.begin << "-" << c.end << " rejected (" << error << ")" << std::endl;
+                        ok = false;
+                        finish(c);
+                    }
+
+                    advance(path, file_size);
+
+                    if (now - last_report >= std::chrono::seconds(5)) {
+                        last_report = now;
+                        std::cerr << path << ": " << (delivered * 100 / chunks.size()) << "% (" << points << " points)" << std::endl;
+                    }
+                }
+
+                return ok;
+            }
+
+            // Called with the mutex held
+            void send(size_t index) {
+                chunk& c = chunks[index];
+                c.attempts++;
+                http.send(index, c.body);
+            }
+
+            void finish(chunk& c) {
+                c.done = true;
+                c.body = std::string();
+                points += c.points;
+                skipped += c.skipped;
+            }
+
+            // Moves the checkpoint past delivered chunks, called with the
+            // mutex held. Returns true if it moved.
+            bool advance(const std::string& path, size_t file_size) {
+                size_t first = delivered;
+
+                while (delivered < chunks.size() && chunks[delivered].done)
+                    delivered++;
+
+                if (delivered == first)
+                    return false;
+
+                progress.set(path, delivered < chunks.size() ? chunks[delivered].begin : file_size);
+                worker_wakeup.notify_all();
+                return true;
+            }
+
+            const options& opts;
+            influxdb::curl_transport& http;
+            checkpoint& progress;
+
+            std::vector<chunk> chunks;
+            std::vector<size_t> retries;
+            size_t next_chunk;
+            size_t delivered;
+            bool stopping;
+            std::mutex mutex;
+            std::condition_variable worker_wakeup;
+            std::condition_variable sender_wakeup;
+
+            uint64_t points;
+            uint64_t skipped;
+    };
+}
+
+int main(int argc, char** argv) {
+    options opts;
+
+    try {
+        opts = parse_args(argc, argv);
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        usage();
+        return 2;
+    }
+
+    influxdb::initialize();
+    int status = 0;
+
+    try {
+        checkpoint progress(opts.checkpoint);
+        std::unique_ptr<influxdb::curl_transport> transport;
+
+        if (opts.v2.bucket.empty())
+            transport.reset(new influxdb::curl_transport(opts.url, opts.db, opts.prec));
+        else
+            transport.reset(new influxdb::curl_transport(opts.url, opts.v2, opts.prec));
+
+        influxdb::curl_transport& http = *transport;
+
+        if (opts.level > 0)
+            http.add_header("Content-Encoding: gzip");
+
+        influxdb::connection_pool pool;
+        pool.max_host_connections = static_cast<long>(opts.concurrency);
+        http.set_connection_pool(pool);
+
+        loader load(opts, http, progress);
+        auto started = std::chrono::steady_clock::now();
+
+        for (const auto& path : opts.inputs) {
+            if (!load.load(path))
+                status = 1;
+        }
+
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        std::cerr << "Loaded " << load.get_points() << " points in " << elapsed << " s";
+
+        if (elapsed > 0)
+            std::cerr << " (" << static_cast<uint64_t>(load.get_points() / elapsed) << " points/s)";
+
+        std::cerr << ", skipped " << load.get_skipped() << " lines" << std::endl;
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        status = 1;
+    }
+
+    influxdb::cleanup();
+    return status;
+}